@@ -4,646 +4,6631 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEQ_X86 1
+#endif
 
-/*Sequences are stored in tree where each node has three sons.
+/*Name of abstraction class, shared by every class with the same name.
 *
-* Each node stores abstract_class_name value where its
-* abstraction class name is stored.
+* references is number of classes and joined names currently using it.
+* Name is freed as soon as it drops to zero.
 *
-* abstract_class stores number of abstraction class
-* in which node belongs. Sequences without abstraction class has this value as -1 in default.
+* next is the following name in the same bucket of the names table.
 *
-* abstract_classes_amount is a pointer to variable determining how many abstraction classes are currently in storage
-* and is used to pick number for new abstraction classes.
+* Name made by merging classes is a join: left followed by right, both
+* of them names it holds a reference of, so that merging takes constant
+* time. Other names keep length characters in text. hash is polynomial
+* hash of the whole text and power is SEQ_NAME_BASE to its length, so that
+* hash of a join comes from hashes of its parts. depth is how many joins
+* there are on the longest way from the name to a part with text.
+*
+* flat is the whole text ending with '\0': text itself, or for a join
+* NULL until it is first asked for, then kept as long as the name.
+*
+* In concurrent storages a name with no references waits on the retired list
+* (linked through next) until no reader can see it, retired is the epoch
+* in which it was dropped. Its parts are dropped when it is freed.
+*/
+typedef struct seq_name {
+    struct seq_name * next;
+    size_t hash;
+    size_t length;
+    uint64_t power;
+    uint64_t retired;
+    struct seq_name * left;
+    struct seq_name * right;
+    char * flat;
+    uint32_t depth;
+    int references;
+    char text[];
+} seq_name_t;
+
+#define SEQ_NAME_BASE 0x100000001B3ULL
+
+/*Memory which seq_reserve put aside for names and texts of members,
+* so that they are made without calling malloc.
+*
+* Blocks are multiples of SEQ_SPARE_UNIT bytes, cut from the newest
+* of regions between next and end. Regions, region_amount of them
+* (with room for region_capacity), are kept in order of their addresses,
+* so that the region holding a block is found by binary search. Blocks
+* given back wait on free[k] for blocks of k + 1 units, linked through
+* their first bytes, and are given out first. Blocks bigger than
+* SEQ_SPARE_CLASSES units, and any block once there is no spare one, come
+* from malloc.
+*
+* fallbacks is how many times names, members or classes of the table
+* called malloc, whether seq_reserve was used or not.
+*/
+#define SEQ_SPARE_UNIT 16
+#define SEQ_SPARE_CLASSES 64
+
+typedef struct seq_spare_region {
+    char * end;
+} __attribute__((aligned(SEQ_SPARE_UNIT))) seq_spare_region_t;
+
+typedef struct seq_spare {
+    seq_spare_region_t ** regions;
+    size_t region_amount;
+    size_t region_capacity;
+    char * next;
+    char * end;
+    void * free[SEQ_SPARE_CLASSES];
+    uint64_t fallbacks;
+} seq_spare_t;
+
+/*Table of all class names in storage, each name is stored there only once.
+*
+* retired is list of names dropped in concurrent storage and not freed yet,
+* deferred tells whether names are put there instead of being freed.
+*
+* spare is memory for names and for texts of members of the same table.
+*/
+typedef struct seq_names {
+    seq_name_t ** buckets;
+    size_t bucket_amount;
+    size_t amount;
+    seq_name_t * retired;
+    bool deferred;
+    seq_spare_t spare;
+} seq_names_t;
+
+/*Abstraction classes are kept in a disjoint-set forest owned by the root.
+*
+* parent is number of the class above in the forest, representative
+* of abstraction class is its own parent.
+*
+* rank is an upper bound of height of the subtree and is used to pick
+* which representative stays when two classes are merged.
+*
+* name is stored only in the representative of the class.
+*
+* members is the first member of the class, SEQ_NO_MEMBER when it has none.
+* It is kept right only in the representative, like name.
+*/
+typedef struct seq_class {
+    int parent;
+    int rank;
+    seq_name_t * name;
+    uint32_t members;
+} seq_class_t;
+
+#define SEQ_NO_MEMBER UINT32_MAX
+
+/*Sequence which belongs to an abstraction class.
+*
+* abs_class is the class the sequence was put in, possibly one which was
+* merged into another class later.
+*
+* Members of one class are on a circular list linked through next and prev,
+* which starts at members of the representative of the class. Removed members
+* are off every list and have both set to SEQ_NO_MEMBER.
+*
+* references is how many nodes besides the first one keep the member,
+* which happens only when a node is copied for snapshots.
+*
+* text keeps the length values of the sequence, four in a byte starting
+* from the lowest bits. It is NULL when the sequence is not known yet,
+* because the member was made through a cursor.
+*
+* Free members are linked through next and have abs_class -1.
+*/
+typedef struct seq_member {
+    uint8_t * text;
+    size_t length;
+    int32_t abs_class;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t references;
+} seq_member_t;
+
+/*Classes are kept in segments like nodes in slabs, segment number k holds
+* SEQ_SEGMENT_MIN_CLASSES * 2^k classes. Segments never move, so readers
+* of concurrent storage can use the table while it grows.
+*/
+#define SEQ_SEGMENT_SHIFT 4
+#define SEQ_SEGMENT_MIN_CLASSES (1U << SEQ_SEGMENT_SHIFT)
+#define SEQ_SEGMENTS (32 - SEQ_SEGMENT_SHIFT)
+
+/*Segment of classes shared by a storage and its snapshots. references is
+* how many of them use it, used is how many classes it held when it was
+* shared first. Nobody changes classes of shared segment, the storage
+* copies it before.
+*/
+typedef struct seq_share {
+    uint32_t references;
+    uint32_t used;
+} seq_share_t;
+
+/*Table of all abstraction classes in storage, their members and names.
+*
+* amount is how many classes are currently in table and is used to pick
+* number for new abstraction classes.
+*
+* shares[k] is NULL unless segment k is shared with snapshots.
+*
+* Members are kept in member_segments the same way as classes. member_amount
+* of them were given out, free_members is the list of those given back.
+* unknown is how many members do not know their sequence.
+*/
+typedef struct seq_classes {
+    seq_class_t * segments[SEQ_SEGMENTS];
+    seq_share_t * shares[SEQ_SEGMENTS];
+    int amount;
+    seq_names_t names;
+    seq_member_t * member_segments[SEQ_SEGMENTS];
+    uint32_t member_amount;
+    uint32_t free_members;
+    uint32_t unknown;
+} seq_classes_t;
+
+/*Returns number of segment in which class number i is kept.*/
+static inline uint32_t class_segment(uint32_t i) {
+    return 31 - __builtin_clz((i >> SEQ_SEGMENT_SHIFT) + 1);
+}
+
+/*Returns class number i from table classes.*/
+static inline seq_class_t * class_at(seq_classes_t const * classes, int i) {
+    uint32_t segment = class_segment((uint32_t) i);
+    return &classes->segments[segment][
+        (uint32_t) i + SEQ_SEGMENT_MIN_CLASSES
+        - (SEQ_SEGMENT_MIN_CLASSES << segment)
+    ];
+}
+
+/*Returns member number m from table classes.*/
+static inline seq_member_t * member_at(seq_classes_t const * classes, uint32_t m) {
+    uint32_t segment = class_segment(m);
+    return &classes->member_segments[segment][
+        m + SEQ_SEGMENT_MIN_CLASSES - (SEQ_SEGMENT_MIN_CLASSES << segment)
+    ];
+}
+
+/*Sequences are stored in tree where each node has SEQ_ALPHABET sons.
+*
+* next[i] is number of the son for value i in slabs of the storage,
+* 0 when there is no such son.
+*
+* abstract_class stores number of the member record of the sequence
+* in the class table, which tells its abstraction class.
+* Sequences without abstraction class has this value as -1 in default.
+*
+* In compressed storages node can also be a run, which packs a chain
+* of length (at most SEQ_RUN_MAX) sequences, each being the only son
+* of the previous one and none having abstraction class:
+* - abstract_class is -1 - length,
+* - next[0] is number of the node following the last sequence of the run,
+*   0 when the last sequence has no sons,
+* - next[1] and next[2] keep values leading from each sequence of the run
+*   to the next one, two bits per value, starting from the lowest bits.
+*
+* Runs need three fields in next, so there are SEQ_NEXT of them even when
+* there are only two values.
+*/
+#define SEQ_NEXT (SEQ_ALPHABET > 3 ? SEQ_ALPHABET : 3)
+
+typedef struct seq_node {
+    uint32_t next[SEQ_NEXT];
+    int32_t abstract_class;
+} seq_node_t;
+
+#define SEQ_RUN_MAX 32
+
+/*Nodes are kept in slabs, slab number k holds SEQ_SLAB_MIN_NODES * 2^k
+* nodes and numbering of its nodes starts where the previous slab ends.
+* Slabs never move, so a node keeps both its number and its address.
+*/
+#define SEQ_SLAB_SHIFT 5
+#define SEQ_SLAB_MIN_NODES (1U << SEQ_SLAB_SHIFT)
+#define SEQ_SLABS (32 - SEQ_SLAB_SHIFT)
+
+/*Storage of sequences.
+*
+* Root of the tree is node root, which is 0 except in snapshots. No node
+* points to a root, so 0 in next means there is no son.
+*
+* used is how many nodes were already given out from slabs.
+*
+* free_nodes is list of nodes returned after removing sequences,
+* linked through their next[0] field. They are given out first.
+*
+* classes is the table of abstraction classes, whose amount field is
+* the only counter of classes in storage. It is own_classes, except in shards
+* of sharded storage, which share the table of the whole storage.
+*
+* compressed tells whether new chains of sequences are added as runs.
+*
+* concurrent tells whether readers may work while the storage is changed.
+* Nodes cut off from the tree then wait in retired, each with the epoch
+* in which it was cut off, until no reader can see them. Nodes are given out
+* from pools, one for each reader slot, instead of free_nodes, so that
+* threads adding sequences together do not share them. Pools lie on cache
+* lines of their own within pools_block, which comes from malloc.
+*
+* generation changes whenever positions of stored sequences may change,
+* so that cursors made before can tell they are stale.
+*
+* sharding is NULL except in sharded storages, which keep no sequences
+* in their own tree and pass every operation on to their shards.
+*
+* mapping is NULL except in storages opened from a snapshot file.
+*
+* frozen is NULL until seq_freeze replaces the tree with its succinct
+* form, which only answers questions; slabs are empty then.
+*
+* batch is NULL except between seq_equiv_begin and seq_equiv_commit
+* or seq_equiv_abort, when it keeps merges waiting to be done.
+*
+* snapshots is how many snapshots share nodes with the storage. While there
+* are any, counts keeps for every node of slabs how many parents it has
+* besides the first one, and nodes with more are copied before they change.
+* origin is NULL except in snapshots, which read nodes from slabs of their
+* origin and give nodes back to it.
+*
+* fallbacks is how many slabs were allocated when a node was needed,
+* instead of by seq_reserve. Slabs lost in a race of concurrent writers
+* are freed and not counted.
+*
+* ops counts operations on the storage, only in builds with SEQ_INSTRUMENT.
 */
 typedef struct seq {
-    struct seq * next_zero;
-    struct seq * next_one;
-    struct seq * next_two;
-    char * abstract_class_name;
-    int abstract_class;
-    int * abstract_classes_amount;
+    seq_node_t * slabs[SEQ_SLABS];
+    uint32_t used;
+    uint32_t free_nodes;
+    seq_classes_t * classes;
+    seq_classes_t own_classes;
+    bool compressed;
+    bool concurrent;
+    uint64_t generation;
+    struct seq_retired * retired;
+    size_t retired_amount;
+    size_t retired_capacity;
+    struct seq_pool * pools;
+    void * pools_block;
+    struct seq_sharding * sharding;
+    struct seq_mapping * mapping;
+    struct seq_frozen * frozen;
+    struct seq_equiv_batch * batch;
+    uint32_t root;
+    uint32_t snapshots;
+    uint32_t * counts[SEQ_SLABS];
+    struct seq * origin;
+    uint64_t fallbacks;
+#ifdef SEQ_INSTRUMENT
+    seq_op_stats_t ops[SEQ_OPS];
+#endif
 } seq_t;
 
-/*Initialize new structure for storing sequences.
-* Creates root of tree where sequences are stored.
+/*Pair of members whose classes seq_equiv_commit merges.*/
+typedef struct seq_equiv_pair {
+    uint32_t member_1;
+    uint32_t member_2;
+} seq_equiv_pair_t;
+
+/*Merges recorded by seq_equiv_add, amount of capacity pairs being used.
+* Member records cannot move, so sequences are not removed until commit.
 */
-seq_t * seq_new(void) {
+typedef struct seq_equiv_batch {
+    seq_equiv_pair_t * pairs;
+    size_t amount;
+    size_t capacity;
+} seq_equiv_batch_t;
+
+/*Class as written in a snapshot file: its representative, rank, first
+* member and offset of its name in the pool of names (SEQ_SNAP_NO_NAME
+* if it has none).
+*/
+typedef struct seq_snap_class {
+    int32_t parent;
+    int32_t rank;
+    uint32_t members;
+    uint32_t reserved;
+    uint64_t name;
+} seq_snap_class_t;
+
+/*Member as written in a snapshot file, with offset of its sequence
+* in the pool of texts (SEQ_SNAP_NO_NAME if it is not known).
+*/
+typedef struct seq_snap_member {
+    int32_t abs_class;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t reserved;
+    uint64_t length;
+    uint64_t text;
+} seq_snap_member_t;
+
+#define SEQ_SNAP_NO_NAME UINT64_MAX
+
+/*Snapshot file mapped to memory at base, size bytes, of which first slabs
+* of the storage are a part. Until the storage is first changed the mapping
+* is read-only and classes, members and names are read straight from
+* the file through classes (amount of them), members (member_amount of them,
+* free_members being the first free one), names and texts; then they are
+* copied to the class table and classes becomes NULL.
+*/
+typedef struct seq_mapping {
+    void * base;
+    size_t size;
+    uint32_t slabs;
+    int amount;
+    uint32_t member_amount;
+    uint32_t free_members;
+    seq_snap_class_t const * classes;
+    seq_snap_member_t const * members;
+    char const * names;
+    uint64_t names_size;
+    uint8_t const * texts;
+    uint64_t texts_size;
+} seq_mapping_t;
+
+int mapping_upgrade(seq_t * p);
+
+/*Makes storage p ready to be changed. In case of error returns -1,
+* for frozen storage or snapshot assigning EPERM to errno.
+*/
+static inline int storage_write(seq_t * p) {
+    if (p->frozen || p->origin) {
+        errno = EPERM;
+        return -1;
+    }
+    if (p->mapping && p->mapping->classes) return mapping_upgrade(p);
+    return 0;
+}
+
+/*SEQ_MEASURE(p, op, call) returns what call returns. In builds with
+* SEQ_INSTRUMENT it also counts call as operation op of storage p, with
+* how long it took. Threads may count together, so counters are atomic.
+*/
+#ifdef SEQ_INSTRUMENT
+static inline uint64_t op_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+static inline void op_record(seq_t * p, int op, uint64_t start) {
+    if (!p) return;
+    uint64_t nanoseconds = op_clock() - start;
+    uint32_t latency = 63 - __builtin_clzll(nanoseconds | 1);
+    if (latency >= SEQ_STATS_LATENCIES) latency = SEQ_STATS_LATENCIES - 1;
+
+    seq_op_stats_t * counter = &p->ops[op];
+    __atomic_fetch_add(&counter->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->nanoseconds, nanoseconds, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->latencies[latency], 1, __ATOMIC_RELAXED);
+}
+
+#define SEQ_MEASURE(p, op, call) do { \
+        uint64_t start_ = op_clock(); \
+        int result_ = (call); \
+        op_record(p, op, start_); \
+        return result_; \
+    } while (0)
+#else
+#define SEQ_MEASURE(p, op, call) return (call)
+#endif
+
+/*Memory for names, defined with them.*/
+void * spare_alloc(seq_spare_t * spare, size_t bytes);
+void spare_free(seq_spare_t * spare, void * block, size_t bytes);
+void spare_clear(seq_spare_t * spare);
+
+/*Names of abstraction classes, defined with classes.*/
+void name_free(seq_names_t * names, seq_name_t * name);
+void name_release(seq_names_t * names, seq_name_t * name);
+
+/*Members of abstraction classes, defined with classes.*/
+void member_free(seq_classes_t * classes, uint32_t m);
+int members_cut(seq_t * p, uint32_t node);
+int members_resolve(seq_t * p);
+
+/*Questions to frozen storages, defined with seq_freeze at the end.*/
+int frozen_valid(seq_t * p, char const * s, size_t length);
+char const * frozen_get_name(seq_t * p, char const * s, size_t length);
+void frozen_delete(seq_t * p);
+
+/*Snapshots, defined with them at the end.*/
+void snapshot_delete(seq_t * p);
+
+/*Batches of merges, defined with seq_equiv_begin.*/
+void batch_free(seq_t * p);
+
+/*Sequence of a batch added by seq_add_batch, with its length.*/
+typedef struct seq_batch_item {
+    char const * s;
+    size_t length;
+} seq_batch_item_t;
+
+/*Operations of sharded storages, defined with them at the end.*/
+int shards_add(seq_t * p, char const * s, size_t length);
+int shards_add_batch(
+    seq_t * p, seq_batch_item_t const * scanned, size_t n, size_t longest
+);
+int shards_remove(seq_t * p, char const * s, size_t length);
+int shards_valid(seq_t * p, char const * s, size_t length);
+int shards_set_name(seq_t * p, char const * s, size_t length, char const * n);
+char const * shards_get_name(seq_t * p, char const * s, size_t length);
+int shards_equiv(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+);
+void shards_delete(seq_t * p);
+
+/*Nodes of concurrent storage owned by one thread: list of free nodes
+* linked through next[0] and nodes from next to end not given out yet,
+* taken by the thread from slabs at once.
+*/
+typedef struct seq_pool {
+    uint32_t free_nodes;
+    uint32_t next;
+    uint32_t end;
+} __attribute__((aligned(64))) seq_pool_t;
+
+/*Subtree cut off from concurrent storage in given epoch.*/
+typedef struct seq_retired {
+    uint64_t epoch;
+    uint32_t node;
+} seq_retired_t;
+
+/*Position of a sequence in the tree: its node and, when the node
+* is a run, which sequence of the run it is (counting from 0).
+*/
+typedef struct seq_pos {
+    uint32_t node;
+    uint32_t offset;
+} seq_pos_t;
+
+/*Returns number of slab in which node number i is kept.*/
+static inline uint32_t seq_slab(uint32_t i) {
+    return 31 - __builtin_clz((i >> SEQ_SLAB_SHIFT) + 1);
+}
+
+/*Returns node number i kept in slabs.*/
+static inline seq_node_t * slabs_node(seq_node_t * const * slabs, uint32_t i) {
+    uint32_t slab = seq_slab(i);
+    return &slabs[slab][i + SEQ_SLAB_MIN_NODES - (SEQ_SLAB_MIN_NODES << slab)];
+}
+
+/*Returns node number i of storage p.*/
+static inline seq_node_t * seq_node(seq_t const * p, uint32_t i) {
+    return slabs_node(p->slabs, i);
+}
+
+/*Returns number of more parents of node number i of storage p
+* which has snapshots.
+*/
+static inline uint32_t * node_count(seq_t const * p, uint32_t i) {
+    uint32_t slab = seq_slab(i);
+    return &p->counts[slab][i + SEQ_SLAB_MIN_NODES - (SEQ_SLAB_MIN_NODES << slab)];
+}
+
+/*Fields of nodes which readers of concurrent storage can see are read and
+* written atomically. A son is linked with release store only when it is
+* fully built, so whatever reader finds through it is ready.
+*/
+static inline uint32_t node_son(seq_node_t const * node, int val) {
+    return __atomic_load_n(&node->next[val], __ATOMIC_ACQUIRE);
+}
+
+static inline void node_link(seq_node_t * node, int val, uint32_t son) {
+    __atomic_store_n(&node->next[val], son, __ATOMIC_RELEASE);
+}
+
+static inline int32_t node_class(seq_node_t const * node) {
+    return __atomic_load_n(&node->abstract_class, __ATOMIC_ACQUIRE);
+}
+
+static inline void node_set_class(seq_node_t * node, int32_t abs_class) {
+    __atomic_store_n(&node->abstract_class, abs_class, __ATOMIC_RELEASE);
+}
+
+static inline bool node_is_run(seq_node_t const * node) {
+    return __atomic_load_n(&node->abstract_class, __ATOMIC_RELAXED) < -1;
+}
+
+static inline uint32_t run_length(seq_node_t const * node) {
+    return (uint32_t) (-1 - node->abstract_class);
+}
+
+static inline uint64_t run_values(seq_node_t const * node) {
+    return ((uint64_t) node->next[2] << 32) | node->next[1];
+}
+
+/*Returns value leading from sequence number i of the run to the next one.*/
+static inline int run_value(seq_node_t const * node, uint32_t i) {
+    return (int) ((run_values(node) >> (2 * i)) & 3);
+}
+
+/*Turns node into a run of length sequences with values and next node son.*/
+static inline void run_set(
+    seq_node_t * node, uint32_t length, uint64_t values, uint32_t son
+    ) {
+    node->abstract_class = -1 - (int32_t) length;
+    node->next[0] = son;
+    node->next[1] = (uint32_t) values;
+    node->next[2] = (uint32_t) (values >> 32);
+}
+
+/*Makes node one with no sons and no abstraction class.*/
+static inline void node_clear(seq_node_t * node) {
+    for (int val = 0; val < SEQ_NEXT; val++) node->next[val] = 0;
+    node->abstract_class = -1;
+}
+
+/*Moves position pos to its son for value val.
+* Returns false and leaves pos as it was if there is no such son.
+*/
+static inline bool pos_next(seq_t const * p, seq_pos_t * pos, int val) {
+    seq_node_t const * current = seq_node(p, pos->node);
+
+    if (!node_is_run(current)) {
+        uint32_t son = node_son(current, val);
+        if (!son) return false;
+        pos->node = son;
+        return true;
+    }
+
+    uint32_t length = run_length(current);
+    if (pos->offset + 1 == length && !current->next[0]) return false;
+    if (run_value(current, pos->offset) != val) return false;
+
+    if (++pos->offset == length) {
+        pos->node = current->next[0];
+        pos->offset = 0;
+    }
+    return true;
+}
+
+/*Readers of concurrent storages announce themselves in slots, one slot
+* per thread, shared by all storages. Epoch grows every time something
+* is cut off from a concurrent storage, and it can be freed once every
+* reader which started before is done.
+*
+* active is epoch in which the thread started reading plus one,
+* 0 when it is not reading. taken tells whether a thread owns the slot.
+*/
+#define SEQ_READERS 256
+
+typedef struct seq_reader {
+    uint64_t active;
+    int taken;
+} __attribute__((aligned(64))) seq_reader_t;
+
+static seq_reader_t seq_readers[SEQ_READERS];
+static uint64_t seq_epoch;
+
+static __thread seq_reader_t * reader_slot;
+static __thread int reader_depth;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+
+/*Gives slot back when its thread ends.*/
+void reader_leave(void * slot) {
+    __atomic_store_n(&((seq_reader_t *) slot)->taken, 0, __ATOMIC_RELEASE);
+}
+
+void reader_key_create(void) {
+    pthread_key_create(&reader_key, reader_leave);
+}
+
+/*Takes a free slot for the calling thread, waiting if all are taken.*/
+seq_reader_t * reader_claim(void) {
+    pthread_once(&reader_once, reader_key_create);
+    for (;;) {
+        for (int i = 0; i < SEQ_READERS; i++) {
+            int free_slot = 0;
+            if (__atomic_compare_exchange_n(&seq_readers[i].taken, &free_slot,
+                1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                pthread_setspecific(reader_key, &seq_readers[i]);
+                return &seq_readers[i];
+            }
+        }
+        sched_yield();
+    }
+}
+
+/*Starts reading concurrent storages in calling thread.
+*
+* Epoch is read again after the slot is written: either it did not change,
+* and then writers see the slot before freeing anything, or the reader
+* already sees everything cut off since and announcing the older epoch
+* only keeps more things alive.
+*/
+void seq_read_begin(void) {
+    if (reader_depth++ > 0) return;
+    if (!reader_slot) reader_slot = reader_claim();
+
+    uint64_t epoch = __atomic_load_n(&seq_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader_slot->active, epoch + 1, __ATOMIC_SEQ_CST);
+    (void) __atomic_load_n(&seq_epoch, __ATOMIC_SEQ_CST);
+}
+
+/*Ends reading started by the matching seq_read_begin.*/
+void seq_read_end(void) {
+    if (--reader_depth > 0) return;
+    __atomic_store_n(&reader_slot->active, 0, __ATOMIC_RELEASE);
+}
+
+/*Returns epoch in which something cut off from concurrent storage right
+* before is retired.
+*/
+static inline uint64_t epoch_retire(void) {
+    return __atomic_fetch_add(&seq_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*Returns the oldest epoch in which some reader may still be reading.
+* Whatever was retired in an earlier epoch can be freed.
+*/
+uint64_t epoch_oldest(void) {
+    uint64_t oldest = __atomic_load_n(&seq_epoch, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < SEQ_READERS; i++) {
+        uint64_t active =
+            __atomic_load_n(&seq_readers[i].active, __ATOMIC_SEQ_CST);
+        if (active && active - 1 < oldest) oldest = active - 1;
+    }
+    return oldest;
+}
+
+/*Returns pool of the calling thread in concurrent storage p.*/
+static inline seq_pool_t * pool_own(seq_t * p) {
+    if (!reader_slot) reader_slot = reader_claim();
+    return &p->pools[reader_slot - seq_readers];
+}
+
+/*Makes sure slab number slab of concurrent storage p is allocated.
+* Threads which allocate it together keep the slab of the first one,
+* which is the only one to get 1, others get 0.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int slab_ensure(seq_t * p, uint32_t slab) {
+    if (__atomic_load_n(&p->slabs[slab], __ATOMIC_ACQUIRE)) return 0;
+
+    seq_node_t * new_slab = (seq_node_t *) malloc(
+        sizeof(seq_node_t) * (SEQ_SLAB_MIN_NODES << slab)
+    );
+    if (!new_slab) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    seq_node_t * empty = NULL;
+    if (!__atomic_compare_exchange_n(&p->slabs[slab], &empty, new_slab,
+        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(new_slab);
+        return 0;
+    }
+    return 1;
+}
+
+/*Same as arena_node for concurrent storage. Nodes are taken from slabs
+* to the pool up to the next multiple of SEQ_SLAB_MIN_NODES, never
+* crossing the end of a slab.
+*/
+uint32_t pool_node(seq_t * p) {
+    seq_pool_t * pool = pool_own(p);
+    uint32_t node = pool->free_nodes;
+
+    if (node) {
+        pool->free_nodes = seq_node(p, node)->next[0];
+    }
+    else {
+        if (pool->next == pool->end) {
+            uint32_t start = __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+            uint32_t end;
+            do {
+                if (seq_slab(start) >= SEQ_SLABS) {
+                    errno = ENOMEM;
+                    return 0;
+                }
+                end = (start | (SEQ_SLAB_MIN_NODES - 1)) + 1;
+            } while (!__atomic_compare_exchange_n(&p->used, &start, end,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            pool->next = start;
+            pool->end = end;
+        }
+
+        int allocated = slab_ensure(p, seq_slab(pool->next));
+        if (allocated == -1) return 0;
+        if (allocated) __atomic_fetch_add(&p->fallbacks, 1, __ATOMIC_RELAXED);
+        node = pool->next++;
+    }
+
+    node_clear(seq_node(p, node));
+
+    return node;
+}
+
+/*Makes counts of slab number slab of storage p, all zero.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int counts_ensure(seq_t * p, uint32_t slab) {
+    if (p->counts[slab]) return 0;
+    p->counts[slab] = (uint32_t *) calloc(SEQ_SLAB_MIN_NODES << slab, sizeof(uint32_t));
+    if (!p->counts[slab]) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/*Frees counts of storage p, once no snapshot shares its nodes.*/
+void counts_clear(seq_t * p) {
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) {
+        free(p->counts[i]);
+        p->counts[i] = NULL;
+    }
+}
+
+/*Gives out number of a new node with no sons and no abstraction class.
+* In case of allocation error returns 0 and assigns ENOMEM to errno.
+*/
+uint32_t arena_node(seq_t * p) {
+    if (p->concurrent) return pool_node(p);
+
+    uint32_t node = p->free_nodes;
+    if (node) {
+        p->free_nodes = seq_node(p, node)->next[0];
+    }
+    else {
+        node = p->used;
+        uint32_t slab = seq_slab(node);
+        if (slab >= SEQ_SLABS) {
+            errno = ENOMEM;
+            return 0;
+        }
+
+        if (!p->slabs[slab]) {
+            p->slabs[slab] = (seq_node_t *) malloc(
+                sizeof(seq_node_t) * (SEQ_SLAB_MIN_NODES << slab)
+            );
+            if (!p->slabs[slab]) {
+                errno = ENOMEM;
+                return 0;
+            }
+            p->fallbacks++;
+        }
+        if (p->snapshots && counts_ensure(p, slab) == -1) return 0;
+        p->used++;
+    }
+
+    node_clear(seq_node(p, node));
+
+    return node;
+}
+
+/*Takes back node so that it can be given out again.*/
+void arena_release(seq_t * p, uint32_t node) {
+    uint32_t * free_nodes = p->concurrent ? &pool_own(p)->free_nodes : &p->free_nodes;
+    seq_node(p, node)->next[0] = *free_nodes;
+    *free_nodes = node;
+}
+
+/*Frees all slabs at once, except those mapped from a snapshot file.*/
+void arena_clear(seq_t * p) {
+    uint32_t mapped = p->mapping ? p->mapping->slabs : 0;
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) {
+        if (p->slabs[i] && i >= mapped) free(p->slabs[i]);
+        p->slabs[i] = NULL;
+    }
+    p->used = 0;
+    p->free_nodes = 0;
+}
+
+/*Creates empty storage, compressed or not.*/
+seq_t * seq_create(bool compressed) {
     seq_t * return_seq = (seq_t *) malloc(sizeof(seq_t));
-    int * abstract_classes = (int *) malloc(sizeof(int));
+    seq_node_t * first_slab =
+        (seq_node_t *) malloc(sizeof(seq_node_t) * SEQ_SLAB_MIN_NODES);
 
-    if (!return_seq || !abstract_classes) {
+    if (!return_seq || !first_slab) {
         errno = ENOMEM;
         if (return_seq) {
             free(return_seq);
             return_seq = NULL;
         }
-        if (abstract_classes) {
-            free(abstract_classes);
-            abstract_classes = NULL;
+        if (first_slab) {
+            free(first_slab);
+            first_slab = NULL;
         }
         return NULL;
     }
 
-    *abstract_classes = 0;
-    return_seq->next_one = NULL;
-    return_seq->next_two = NULL;
-    return_seq->next_zero = NULL;
-    return_seq->abstract_class = -1;
-    return_seq->abstract_classes_amount = abstract_classes;
-    return_seq->abstract_class_name = NULL;
-    
-    return return_seq;
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) return_seq->slabs[i] = NULL;
+    return_seq->slabs[0] = first_slab;
+    return_seq->used = 1;
+    return_seq->free_nodes = 0;
+    return_seq->classes = &return_seq->own_classes;
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        return_seq->own_classes.segments[i] = NULL;
+        return_seq->own_classes.shares[i] = NULL;
+    }
+    return_seq->own_classes.amount = 0;
+    return_seq->own_classes.names.buckets = NULL;
+    return_seq->own_classes.names.bucket_amount = 0;
+    return_seq->own_classes.names.amount = 0;
+    return_seq->own_classes.names.retired = NULL;
+    return_seq->own_classes.names.deferred = false;
+    return_seq->own_classes.names.spare.regions = NULL;
+    return_seq->own_classes.names.spare.region_amount = 0;
+    return_seq->own_classes.names.spare.region_capacity = 0;
+    return_seq->own_classes.names.spare.next = NULL;
+    return_seq->own_classes.names.spare.end = NULL;
+    for (uint32_t i = 0; i < SEQ_SPARE_CLASSES; i++)
+        return_seq->own_classes.names.spare.free[i] = NULL;
+    return_seq->own_classes.names.spare.fallbacks = 0;
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++)
+        return_seq->own_classes.member_segments[i] = NULL;
+    return_seq->own_classes.member_amount = 0;
+    return_seq->own_classes.free_members = SEQ_NO_MEMBER;
+    return_seq->own_classes.unknown = 0;
+    return_seq->compressed = compressed;
+    return_seq->concurrent = false;
+    return_seq->generation = 0;
+    return_seq->retired = NULL;
+    return_seq->retired_amount = 0;
+    return_seq->retired_capacity = 0;
+    return_seq->pools = NULL;
+    return_seq->pools_block = NULL;
+    return_seq->sharding = NULL;
+    return_seq->mapping = NULL;
+    return_seq->frozen = NULL;
+    return_seq->batch = NULL;
+    return_seq->root = 0;
+    return_seq->snapshots = 0;
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) return_seq->counts[i] = NULL;
+    return_seq->origin = NULL;
+    return_seq->fallbacks = 0;
+#ifdef SEQ_INSTRUMENT
+    memset(return_seq->ops, 0, sizeof(return_seq->ops));
+#endif
+
+    node_clear(&first_slab[0]);
+    
+    return return_seq;
+}
+
+/*Initialize new structure for storing sequences.
+* Creates root of tree where sequences are stored.
+*/
+seq_t * seq_new(void) {
+    return seq_create(false);
+}
+
+/*Initialize new structure for storing sequences in which chains
+* of sequences having only one son are packed into runs.
+*/
+seq_t * seq_new_compressed(void) {
+    return seq_create(true);
+}
+
+/*Initialize new structure for storing sequences, which can be read
+* by many threads while one thread changes it.
+*/
+seq_t * seq_new_concurrent(void) {
+    seq_t * return_seq = seq_create(false);
+    if (!return_seq) return NULL;
+
+    return_seq->pools_block =
+        malloc(sizeof(seq_pool_t) * SEQ_READERS + _Alignof(seq_pool_t) - 1);
+    if (!return_seq->pools_block) {
+        seq_delete(return_seq);
+        errno = ENOMEM;
+        return NULL;
+    }
+    uintptr_t address = (uintptr_t) return_seq->pools_block + _Alignof(seq_pool_t) - 1;
+    return_seq->pools =
+        (seq_pool_t *) (address - address % _Alignof(seq_pool_t));
+
+    memset(return_seq->pools, 0, sizeof(seq_pool_t) * SEQ_READERS);
+    return_seq->concurrent = true;
+    return_seq->own_classes.names.deferred = true;
+    return return_seq;
+}
+
+/*Sequences given with length SEQ_TERMINATED end at '\0' instead.*/
+#define SEQ_TERMINATED SIZE_MAX
+
+/*Symbols follow each other as the characters '0', '1', '2' and '3' do,
+* so that value of a symbol is its distance from SEQ_SYMBOL_0. Otherwise
+* values and symbols are looked up in tables.
+*/
+#define SEQ_SYMBOLS_IN_ROW (SEQ_SYMBOL_1 == SEQ_SYMBOL_0 + 1 \
+    && (SEQ_ALPHABET < 3 || SEQ_SYMBOL_2 == SEQ_SYMBOL_0 + 2) \
+    && (SEQ_ALPHABET < 4 || SEQ_SYMBOL_3 == SEQ_SYMBOL_0 + 3))
+
+#if !SEQ_SYMBOLS_IN_ROW
+/*Value of every character increased by one, 0 for those which are not symbols.*/
+static uint8_t const seq_values[256] = {
+    [(unsigned char) SEQ_SYMBOL_0] = 1,
+    [(unsigned char) SEQ_SYMBOL_1] = 2,
+#if SEQ_ALPHABET > 2
+    [(unsigned char) SEQ_SYMBOL_2] = 3,
+#endif
+#if SEQ_ALPHABET > 3
+    [(unsigned char) SEQ_SYMBOL_3] = 4,
+#endif
+};
+
+/*Symbol of every value.*/
+static char const seq_symbols[SEQ_ALPHABET] = {
+    SEQ_SYMBOL_0,
+    SEQ_SYMBOL_1,
+#if SEQ_ALPHABET > 2
+    SEQ_SYMBOL_2,
+#endif
+#if SEQ_ALPHABET > 3
+    SEQ_SYMBOL_3,
+#endif
+};
+#endif
+
+/*Returns value of character c, SEQ_ALPHABET or more if it is no symbol.*/
+static inline unsigned seq_value(char c) {
+#if SEQ_SYMBOLS_IN_ROW
+    return (unsigned) ((unsigned char) c - (unsigned char) SEQ_SYMBOL_0);
+#else
+    return (unsigned) seq_values[(unsigned char) c] - 1;
+#endif
+}
+
+/*Returns symbol of value val.*/
+static inline char seq_symbol(int val) {
+#if SEQ_SYMBOLS_IN_ROW
+    return (char) (SEQ_SYMBOL_0 + val);
+#else
+    return seq_symbols[val];
+#endif
+}
+
+/*Value of element i of sequence s returned by seq_at after end of sequence.*/
+#define SEQ_END SEQ_ALPHABET
+/*Value returned by seq_at for an element which is not a symbol.*/
+#define SEQ_WRONG (SEQ_ALPHABET + 1)
+
+/*Returns value of element i of sequence s of given length,
+* SEQ_END past its end and SEQ_WRONG for an illegal element.
+*/
+static inline int seq_at(char const * s, size_t length, size_t i) {
+    if (i >= length) return SEQ_END;
+
+    unsigned val = seq_value(s[i]);
+    if (val < SEQ_ALPHABET) return (int) val;
+    if (!s[i] && length == SEQ_TERMINATED) return SEQ_END;
+    return SEQ_WRONG;
+}
+
+/*Value returned by seq_scan for sequence with illegal element.*/
+#define SEQ_SCAN_WRONG SIZE_MAX
+
+/*Checks elements of sequence s of given length one by one, starting from
+* element i. Returns index where the sequence ends or SEQ_SCAN_WRONG if
+* an illegal element comes first.
+*/
+size_t scan_scalar(char const * s, size_t length, size_t i) {
+    for (;; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return i;
+        if (val == SEQ_WRONG) return SEQ_SCAN_WRONG;
+    }
+}
+
+#if defined(SEQ_X86) && SEQ_SYMBOLS_IN_ROW
+/*Same as scan_scalar, checking 16 elements at a time.
+*
+* Sequences ending at '\0' are read in aligned blocks, each one within a
+* single page, so the block holding '\0' may be read past the end of
+* string but never into memory which is not mapped.
+*/
+__attribute__((no_sanitize_address))
+size_t scan_sse2(char const * s, size_t length, size_t i) {
+    __m128i const zero_char = _mm_set1_epi8(SEQ_SYMBOL_0);
+    __m128i const two = _mm_set1_epi8(SEQ_ALPHABET - 1);
+    __m128i const zero = _mm_setzero_si128();
+
+    if (length != SEQ_TERMINATED) {
+        for (; length - i >= 16; i += 16) {
+            __m128i block = _mm_loadu_si128((__m128i const *) (s + i));
+            __m128i over = _mm_subs_epu8(_mm_sub_epi8(block, zero_char), two);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xFFFF)
+                return SEQ_SCAN_WRONG;
+        }
+        return scan_scalar(s, length, i);
+    }
+
+    for (; (uintptr_t) (s + i) & 15; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return i;
+        if (val == SEQ_WRONG) return SEQ_SCAN_WRONG;
+    }
+
+    for (;; i += 16) {
+        __m128i block = _mm_load_si128((__m128i const *) (s + i));
+        __m128i over = _mm_subs_epu8(_mm_sub_epi8(block, zero_char), two);
+        unsigned wrong =
+            ~(unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) & 0xFFFFU;
+        if (wrong) {
+            size_t first = i + (size_t) __builtin_ctz(wrong);
+            return s[first] ? SEQ_SCAN_WRONG : first;
+        }
+    }
+}
+
+/*Same as scan_sse2, checking 32 elements at a time.*/
+__attribute__((no_sanitize_address, target("avx2")))
+size_t scan_avx2(char const * s, size_t length, size_t i) {
+    __m256i const zero_char = _mm256_set1_epi8(SEQ_SYMBOL_0);
+    __m256i const two = _mm256_set1_epi8(SEQ_ALPHABET - 1);
+    __m256i const zero = _mm256_setzero_si256();
+
+    if (length != SEQ_TERMINATED) {
+        for (; length - i >= 32; i += 32) {
+            __m256i block = _mm256_loadu_si256((__m256i const *) (s + i));
+            __m256i over =
+                _mm256_subs_epu8(_mm256_sub_epi8(block, zero_char), two);
+            if ((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(over, zero))
+                != 0xFFFFFFFFU) return SEQ_SCAN_WRONG;
+        }
+        return scan_scalar(s, length, i);
+    }
+
+    for (; (uintptr_t) (s + i) & 31; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return i;
+        if (val == SEQ_WRONG) return SEQ_SCAN_WRONG;
+    }
+
+    for (;; i += 32) {
+        __m256i block = _mm256_load_si256((__m256i const *) (s + i));
+        __m256i over = _mm256_subs_epu8(_mm256_sub_epi8(block, zero_char), two);
+        unsigned wrong =
+            ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(over, zero));
+        if (wrong) {
+            size_t first = i + (size_t) __builtin_ctz(wrong);
+            return s[first] ? SEQ_SCAN_WRONG : first;
+        }
+    }
+}
+#endif
+
+typedef size_t (* seq_scan_t)(char const *, size_t, size_t);
+
+size_t scan_first(char const * s, size_t length, size_t i);
+
+/*Kernel used by seq_scan, picked for the processor on the first call.*/
+static seq_scan_t scan_kernel = scan_first;
+
+/*Picks the best kernel this processor can run and scans with it.*/
+size_t scan_first(char const * s, size_t length, size_t i) {
+    seq_scan_t kernel = scan_scalar;
+#if defined(SEQ_X86) && SEQ_SYMBOLS_IN_ROW
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+    __atomic_store_n(&scan_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel(s, length, i);
+}
+
+/*Checks elements of sequence s of given length starting from element i and
+* finds where it ends, both in one pass. Returns index of the end
+* or SEQ_SCAN_WRONG if there is an illegal element.
+*/
+static inline size_t seq_scan(char const * s, size_t length, size_t i) {
+    return __atomic_load_n(&scan_kernel, __ATOMIC_RELAXED)(s, length, i);
+}
+
+/*Check if there are any illegal values in sequence s with given length,
+* starting from element i. In such case returns -1 and turns errno to EINVAL.
+* For correct sequences returns 0.
+*/
+int check_str_for_inval(char const * s, size_t length, size_t i) {
+    if (seq_scan(s, length, i) == SEQ_SCAN_WRONG) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*Makes node a member of the list of nodes waiting for removal,
+* which is linked through abstract_class. A run keeps only its son,
+* so after that every waiting node is a plain node with up to SEQ_ALPHABET sons.
+* Member record of the sequence of the node is given back first.
+* Node which has another parent only loses one.
+*/
+static inline void remove_push(seq_t * p, uint32_t * waiting, uint32_t node) {
+    if (p->snapshots && *node_count(p, node) > 0) {
+        (*node_count(p, node))--;
+        return;
+    }
+
+    seq_node_t * current = seq_node(p, node);
+    if (node_is_run(current)) {
+        current->next[1] = 0;
+        current->next[2] = 0;
+    }
+    else if (current->abstract_class >= 0) {
+        member_free(p->classes, (uint32_t) current->abstract_class);
+    }
+    current->abstract_class = (int32_t) *waiting;
+    *waiting = node;
+}
+
+/*Deleting sequence ending on node and all sequences which have it as prefix.
+* Nodes are given back to the allocator of the storage.
+*
+* Nodes waiting for removal are kept on a list threaded through the nodes
+* themselves, so no stack is needed however deep the tree is.
+*/
+void seq_remove_recur(seq_t * p, uint32_t node) {
+    uint32_t waiting = 0;
+    if (node != 0) remove_push(p, &waiting, node);
+
+    while (waiting != 0) {
+        uint32_t removed = waiting;
+        seq_node_t * current = seq_node(p, removed);
+        waiting = (uint32_t) current->abstract_class;
+
+        for (int i = 0; i < SEQ_NEXT; i++) {
+            if (current->next[i] != 0) remove_push(p, &waiting, current->next[i]);
+            current->next[i] = 0;
+        }
+
+        arena_release(p, removed);
+    }
+}
+
+/*Makes room for count more retired subtrees, so that cutting them off
+* cannot fail later. In case of allocation error returns -1 and assigns
+* ENOMEM to errno.
+*/
+int retired_reserve(seq_t * p, size_t count) {
+    if (p->retired_capacity - p->retired_amount >= count) return 0;
+
+    size_t new_capacity = p->retired_capacity ? 2 * p->retired_capacity : 16;
+    while (new_capacity - p->retired_amount < count) new_capacity *= 2;
+    seq_retired_t * new_retired = (seq_retired_t *) realloc(
+        p->retired, sizeof(seq_retired_t) * new_capacity
+    );
+    if (!new_retired) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    p->retired = new_retired;
+    p->retired_capacity = new_capacity;
+    return 0;
+}
+
+/*Deletes subtree starting at node, which was just cut off from the tree.
+* In concurrent storages it is only retired, there must be room for it.
+*/
+void subtree_drop(seq_t * p, uint32_t node) {
+    if (!p->concurrent) {
+        seq_remove_recur(p, node);
+        return;
+    }
+
+    p->retired[p->retired_amount].epoch = epoch_retire();
+    p->retired[p->retired_amount].node = node;
+    p->retired_amount++;
+}
+
+/*Frees names retired from table names which no reader can see any more.*/
+void names_reclaim(seq_names_t * names) {
+    uint64_t oldest = epoch_oldest();
+    seq_name_t ** current = &names->retired;
+    while (*current) {
+        seq_name_t * name = *current;
+        if (name->retired < oldest) {
+            *current = name->next;
+            if (name->left) {
+                name_release(names, name->left);
+                name_release(names, name->right);
+            }
+            name_free(names, name);
+        }
+        else {
+            current = &name->next;
+        }
+    }
+}
+
+/*Frees subtrees and names retired from concurrent storage p
+* which no reader can see any more.
+*/
+void retired_reclaim(seq_t * p) {
+    uint64_t oldest = epoch_oldest();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < p->retired_amount; i++) {
+        if (p->retired[i].epoch < oldest) seq_remove_recur(p, p->retired[i].node);
+        else p->retired[kept++] = p->retired[i];
+    }
+    p->retired_amount = kept;
+    names_reclaim(&p->classes->names);
+}
+
+/*Takes back whatever can already be freed, if anything was retired.*/
+static inline void retired_collect(seq_t * p) {
+    if (p->retired_amount > 0 || p->classes->names.retired) retired_reclaim(p);
+}
+
+/*Creates nodes for sequence s without its first i elements, together with
+* all its prefixes longer than i. Elements up to end are correct.
+* Each of them is the only son of the previous one, the first is for
+* element i. Chain is not attached anywhere. Returns number of its first node.
+*
+* In case of allocation error frees created nodes, returns 0
+* and assigns ENOMEM to errno.
+*/
+uint32_t chain_new(seq_t * p, char const * s, size_t i, size_t end) {
+    uint32_t first = 0;
+    uint32_t last = 0;
+
+    while (i < end) {
+        uint32_t node = arena_node(p);
+        if (!node) {
+            seq_remove_recur(p, first);
+            return 0;
+        }
+
+        if (last) {
+            seq_node_t * previous = seq_node(p, last);
+            if (node_is_run(previous)) previous->next[0] = node;
+            else previous->next[seq_value(s[i])] = node;
+        }
+        else {
+            first = node;
+        }
+        last = node;
+
+        if (p->compressed) {
+            size_t count = end - i < SEQ_RUN_MAX ? end - i : SEQ_RUN_MAX;
+            size_t known = i + count < end ? count : count - 1;
+            uint64_t values = 0;
+            for (size_t j = 0; j < known; j++)
+                values |= (uint64_t) seq_value(s[i + 1 + j]) << (2 * j);
+            run_set(seq_node(p, node), (uint32_t) count, values, 0);
+            i += count;
+        }
+        else {
+            i++;
+        }
+    }
+
+    return first;
+}
+
+/*Makes sure sequence at position pos has its own ordinary node, so that
+* it can get sons or abstraction class. Runs are cut into at most
+* two runs and an ordinary node between them. Afterwards pos shows the
+* ordinary node.
+*
+* In case of allocation error leaves the tree as it was,
+* returns -1 and assigns ENOMEM to errno.
+*/
+int pos_split(seq_t * p, seq_pos_t * pos) {
+    seq_node_t * run = seq_node(p, pos->node);
+    if (!node_is_run(run)) return 0;
+
+    uint32_t length = run_length(run);
+    uint32_t offset = pos->offset;
+    uint32_t son = run->next[0];
+    uint64_t values = run_values(run);
+
+    uint32_t middle = pos->node;
+    uint32_t rest = 0;
+
+    if (offset > 0) {
+        middle = arena_node(p);
+        if (!middle) return -1;
+    }
+    if (offset + 1 < length) {
+        rest = arena_node(p);
+        if (!rest) {
+            if (middle != pos->node) arena_release(p, middle);
+            return -1;
+        }
+        run_set(seq_node(p, rest), length - offset - 1,
+            values >> (2 * (offset + 1)), son);
+    }
+
+    seq_node_t * middle_node = seq_node(p, middle);
+    if (offset > 0) run_set(run, offset, values, middle);
+    node_clear(middle_node);
+
+    int val = (int) ((values >> (2 * offset)) & 3);
+    if (rest) middle_node->next[val] = rest;
+    else if (son) middle_node->next[val] = son;
+
+    pos->node = middle;
+    pos->offset = 0;
+    p->generation++;
+    return 0;
+}
+
+/*Attaches chain as the son for value val of ordinary node at position pos.
+* In concurrent storages other threads may attach a son there at the same
+* time, then only the first one succeeds. Returns whether chain was attached.
+*/
+static inline bool pos_attach(seq_t * p, seq_pos_t pos, int val, uint32_t chain) {
+    seq_node_t * node = seq_node(p, pos.node);
+    if (!p->concurrent) {
+        node_link(node, val, chain);
+        return true;
+    }
+
+    uint32_t empty = 0;
+    return __atomic_compare_exchange_n(&node->next[val], &empty, chain,
+        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/*Cuts off the son for value val of sequence at position pos.*/
+void pos_unlink(seq_t * p, seq_pos_t pos, int val) {
+    seq_node_t * current = seq_node(p, pos.node);
+    if (node_is_run(current)) current->next[0] = 0;
+    else node_link(current, val, 0);
+}
+
+/*Moves position pos along sequence s of given length, so that it shows
+* the sequence at pos followed by s, checking elements of s on the way.
+*
+* Returns 1 if it is stored there, 0 if it is not, leaving pos anywhere
+* on the way. Returns -1 and assigns EINVAL to errno for empty sequence
+* or one with illegal values.
+*/
+int pos_find(seq_t const * p, char const * s, size_t length, seq_pos_t * pos) {
+    if (seq_at(s, length, 0) == SEQ_END) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0;; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return 1;
+        if (val == SEQ_WRONG) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!pos_next(p, pos, val))
+            return check_str_for_inval(s, length, i + 1) == -1 ? -1 : 0;
+    }
+}
+
+/*Finds position of sequence s of given length in storage p,
+* checking its elements on the way. Returns the same as pos_find.
+*/
+int seq_find(seq_t const * p, char const * s, size_t length, seq_pos_t * pos) {
+    pos->node = p->root;
+    pos->offset = 0;
+    return pos_find(p, s, length, pos);
+}
+
+/*Makes copy of node number node of storage p, which has another parent,
+* for the parent which is about to change it. Sons and member of the node
+* get one more parent, the node loses one. Returns number of the copy.
+*
+* In case of allocation error returns 0 and assigns ENOMEM to errno.
+*/
+uint32_t node_copy(seq_t * p, uint32_t node) {
+    uint32_t copy = arena_node(p);
+    if (!copy) return 0;
+
+    seq_node_t const * original = seq_node(p, node);
+    *seq_node(p, copy) = *original;
+    int sons = node_is_run(original) ? 1 : SEQ_ALPHABET;
+    for (int val = 0; val < sons; val++)
+        if (original->next[val]) (*node_count(p, original->next[val]))++;
+    if (original->abstract_class >= 0)
+        member_at(p->classes, (uint32_t) original->abstract_class)->references++;
+
+    (*node_count(p, node))--;
+    return copy;
+}
+
+/*Moves position pos to its son for value val like pos_next, in storage
+* which has snapshots. Son which snapshots also see is copied first, so
+* when pos showed a node of the storage alone, it still does.
+*
+* Returns 1, 0 if there is no such son, or -1 with ENOMEM in errno.
+*/
+int pos_next_own(seq_t * p, seq_pos_t * pos, int val) {
+    seq_pos_t son = *pos;
+    if (!pos_next(p, &son, val)) return 0;
+
+    if (son.node != pos->node && *node_count(p, son.node) > 0) {
+        uint32_t copy = node_copy(p, son.node);
+        if (!copy) return -1;
+
+        seq_node_t * parent = seq_node(p, pos->node);
+        if (node_is_run(parent)) parent->next[0] = copy;
+        else node_link(parent, val, copy);
+        son.node = copy;
+    }
+
+    *pos = son;
+    return 1;
+}
+
+/*Same as pos_next, copying nodes shared with snapshots on the way.*/
+static inline int pos_step(seq_t * p, seq_pos_t * pos, int val) {
+    if (p->snapshots) return pos_next_own(p, pos, val);
+    return pos_next(p, pos, val);
+}
+
+/*Moves position pos along correct sequence s of given length, which is
+* stored after it, copying nodes shared with snapshots. Afterwards pos
+* and the way to it belong to storage p alone.
+*
+* In case of allocation error returns -1 and assigns ENOMEM to errno,
+* what was copied stays in the tree.
+*/
+int pos_own(seq_t * p, char const * s, size_t length, seq_pos_t * pos) {
+    for (size_t i = 0;; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return 0;
+        if (pos_next_own(p, pos, val) == -1) return -1;
+    }
+}
+
+/*Finds again position of stored sequence s of given length in storage p
+* with snapshots, so that nothing on the way is shared with them.
+* Returns 0, or -1 with ENOMEM.
+*/
+int seq_own(seq_t * p, char const * s, size_t length, seq_pos_t * pos) {
+    pos->node = 0;
+    pos->offset = 0;
+    return pos_own(p, s, length, pos);
+}
+
+/*Number of sequences looked up together by find_group.*/
+#define SEQ_GROUP 16
+
+/*Same as seq_find for n (at most SEQ_GROUP) sequences from seqs,
+* of lengths from lengths, all ending with '\0' if lengths is NULL.
+* Results go to found, positions to pos.
+*
+* Sequences are walked together, one element of each in turn, and node
+* which a sequence reaches is prefetched before its turn comes again.
+* So waiting for memory is shared by the whole group.
+*/
+void find_group(
+    seq_t const * p, char const * const * seqs, size_t const * lengths,
+    size_t n, int * found, seq_pos_t * pos
+    ) {
+    size_t active[SEQ_GROUP];
+    size_t at[SEQ_GROUP];
+    size_t count = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        pos[k].node = p->root;
+        pos[k].offset = 0;
+        at[k] = 0;
+        size_t length = lengths ? lengths[k] : SEQ_TERMINATED;
+        if (!seqs[k] || seq_at(seqs[k], length, 0) == SEQ_END) found[k] = -1;
+        else active[count++] = k;
+    }
+
+    while (count > 0) {
+        for (size_t a = 0; a < count;) {
+            size_t k = active[a];
+            size_t length = lengths ? lengths[k] : SEQ_TERMINATED;
+            int val = seq_at(seqs[k], length, at[k]);
+            int result = 2;
+
+            if (val == SEQ_END) result = 1;
+            else if (val == SEQ_WRONG) result = -1;
+            else if (!pos_next(p, &pos[k], val))
+                result = check_str_for_inval(seqs[k], length, at[k] + 1);
+
+            if (result != 2) {
+                found[k] = result;
+                active[a] = active[--count];
+                continue;
+            }
+
+            at[k]++;
+            __builtin_prefetch(seq_node(p, pos[k].node));
+            a++;
+        }
+    }
+}
+
+/*Chain attached to the tree as son for value val of node parent.*/
+typedef struct seq_batch_link {
+    uint32_t parent;
+    int val;
+} seq_batch_link_t;
+
+/*Cuts off chain attached at link and deletes it.
+* In concurrent storages there must be room to retire it.
+*/
+void link_cut(seq_t * p, seq_batch_link_t link) {
+    seq_node_t * parent = seq_node(p, link.parent);
+    uint32_t chain = parent->next[link.val];
+    node_link(parent, link.val, 0);
+    subtree_drop(p, chain);
+}
+
+/*Same as seq_add_n, when anything was added tells where in link
+* (if it is not NULL), so that it can be cut off again.
+*/
+int add_link(seq_t * p, char const * s, size_t length, seq_batch_link_t * link) {
+
+    seq_pos_t current_seq = {0, 0};
+    size_t i = 0;
+    size_t end = 0;
+    int val = seq_at(s, length, 0);
+
+    if (val == SEQ_END) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (storage_write(p) == -1) return -1;
+
+    for (;;) {
+        for (;; i++) {
+            val = seq_at(s, length, i);
+            if (val == SEQ_END) return 0;
+            if (val == SEQ_WRONG) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (!pos_next(p, &current_seq, val)) break;
+        }
+
+        if (!end) {
+            end = seq_scan(s, length, i + 1);
+            if (end == SEQ_SCAN_WRONG) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        if (p->snapshots && seq_own(p, s, i, &current_seq) == -1) return -1;
+
+        uint32_t first_added_seq = chain_new(p, s, i, end);
+        if (!first_added_seq) return -1;
+
+        if (pos_split(p, &current_seq) == -1) {
+            seq_remove_recur(p, first_added_seq);
+            return -1;
+        }
+
+        if (pos_attach(p, current_seq, val, first_added_seq)) {
+            if (link) {
+                link->parent = current_seq.node;
+                link->val = val;
+            }
+            return 1;
+        }
+
+        /*Another thread added this son first, go on along its nodes.*/
+        seq_remove_recur(p, first_added_seq);
+    }
+}
+
+/*Adds to storage sequence s of given length and all of its prefixes.
+* In case of allocation error deletes all already added sequences in procedure.
+*/
+int add_n(seq_t * p, char const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) return shards_add(p, s, length);
+
+    return add_link(p, s, length, NULL);
+}
+
+/*Does add_n, counted as SEQ_OP_ADD.*/
+int seq_add_n(seq_t * p, char const * s, size_t length) {
+    SEQ_MEASURE(p, SEQ_OP_ADD, add_n(p, s, length));
+}
+
+/*Adds to storage sequence s and all of its prefixes.
+* In case of allocation error deletes all already added sequences in procedure.
+*/
+int seq_add(seq_t * p, char const * s) {
+    return seq_add_n(p, s, SEQ_TERMINATED);
+}
+
+/*Orders sequences so that those sharing a prefix are next to each other.*/
+int batch_compare(void const * a, void const * b) {
+    seq_batch_item_t const * x = (seq_batch_item_t const *) a;
+    seq_batch_item_t const * y = (seq_batch_item_t const *) b;
+    size_t length = x->length < y->length ? x->length : y->length;
+    int order = memcmp(x->s, y->s, length);
+    if (order) return order;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+/*Returns length of the longest common prefix of sequences x and y.*/
+static inline size_t batch_common(
+    seq_batch_item_t const * x, seq_batch_item_t const * y
+    ) {
+    size_t length = x->length < y->length ? x->length : y->length;
+    size_t i = 0;
+    while (i < length && x->s[i] == y->s[i]) i++;
+    return i;
+}
+
+/*Cuts off amount chains attached at links, the last one first.*/
+void batch_rollback(seq_t * p, seq_batch_link_t const * links, size_t amount) {
+    while (amount > 0) link_cut(p, links[--amount]);
+}
+
+/*Adds n sorted sequences from items to storage p. path has place for
+* positions of all prefixes of the longest one, links for n chains.
+* Number of chains attached goes to linked.
+*
+* Positions of the prefixes of the last added sequence are kept in path,
+* so a prefix shared with the next one is not walked again.
+* New chains are only walked when a following sequence continues them.
+*
+* In case of allocation error deletes all chains attached in procedure,
+* runs which were cut into parts and nodes copied for snapshots
+* in the meantime stay so.
+*/
+int batch_insert(
+    seq_t * p, seq_batch_item_t const * items, size_t n,
+    seq_pos_t * path, seq_batch_link_t * links, size_t * linked_out
+    ) {
+    /*path[j] is position of prefix of length j of the last sequence,
+    * known for j up to walked.
+    */
+    path[0].node = 0;
+    path[0].offset = 0;
+    size_t walked = 0;
+    size_t linked = 0;
+    *linked_out = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        char const * s = items[k].s;
+        size_t length = items[k].length;
+        size_t i = 0;
+
+        if (k > 0) {
+            i = batch_common(&items[k - 1], &items[k]);
+            if (i > walked) i = walked;
+        }
+
+        int moved = 1;
+        for (; i < length; i++) {
+            path[i + 1] = path[i];
+            moved = pos_step(p, &path[i + 1], (int) seq_value(s[i]));
+            if (moved != 1) break;
+        }
+        walked = i;
+        if (i == length) continue;
+
+        uint32_t first_added_seq = moved == -1 ? 0 : chain_new(p, s, i, length);
+        if (first_added_seq && pos_split(p, &path[i]) == -1) {
+            seq_remove_recur(p, first_added_seq);
+            first_added_seq = 0;
+        }
+
+        if (!first_added_seq) {
+            batch_rollback(p, links, linked);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        node_link(seq_node(p, path[i].node), (int) seq_value(s[i]), first_added_seq);
+        links[linked].parent = path[i].node;
+        links[linked].val = (int) seq_value(s[i]);
+        linked++;
+    }
+
+    *linked_out = linked;
+    return linked > 0 ? 1 : 0;
+}
+
+/*Adds n sequences from seqs and all their prefixes to storage p.
+* Sequences are sorted first, so the ones sharing a prefix come one after
+* another. All of them are checked before anything is added.
+* In case of allocation error deletes everything added in procedure.
+*/
+int seq_add_batch(seq_t * p, char const * const * seqs, size_t n) {
+    if (!p || (!seqs && n > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n == 0) return 0;
+
+    /*Lengths found while sequences are checked are kept in items.*/
+    seq_batch_item_t * items =
+        (seq_batch_item_t *) malloc(sizeof(seq_batch_item_t) * n);
+    if (!items) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t longest = 0;
+    bool sorted = true;
+    for (size_t k = 0; k < n; k++) {
+        size_t length = seqs[k] ? seq_scan(seqs[k], SEQ_TERMINATED, 0) : 0;
+        if (length == 0 || length == SEQ_SCAN_WRONG) {
+            free(items);
+            errno = EINVAL;
+            return -1;
+        }
+        if (length > longest) longest = length;
+        items[k].s = seqs[k];
+        items[k].length = length;
+        if (k > 0 && sorted && batch_compare(&items[k - 1], &items[k]) > 0)
+            sorted = false;
+    }
+    if (p->sharding) {
+        int result = shards_add_batch(p, items, n, longest);
+        free(items);
+        return result;
+    }
+    if (storage_write(p) == -1) {
+        free(items);
+        return -1;
+    }
+
+    seq_batch_link_t * links =
+        (seq_batch_link_t *) malloc(sizeof(seq_batch_link_t) * n);
+    seq_pos_t * path = (seq_pos_t *) malloc(sizeof(seq_pos_t) * (longest + 1));
+
+    int result = -1;
+    if (p->concurrent) retired_collect(p);
+    if (!links || !path || (p->concurrent && retired_reserve(p, n) == -1)) {
+        errno = ENOMEM;
+    }
+    else {
+        if (!sorted) qsort(items, n, sizeof(seq_batch_item_t), batch_compare);
+        size_t linked;
+        result = batch_insert(p, items, n, path, links, &linked);
+    }
+
+    free(items);
+    free(links);
+    free(path);
+    return result;
+}
+
+/*Deletes sequence s of given length from structure and all sequences
+* for which s is a prefix.
+*/
+int remove_n(seq_t * p, char const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->batch) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (p->sharding) return shards_remove(p, s, length);
+    if (storage_write(p) == -1) return -1;
+
+    seq_pos_t current_seq = {0, 0};
+    seq_pos_t second_to_last = current_seq;
+    size_t last = 0;
+    int last_val = seq_at(s, length, 0);
+
+    if (last_val == SEQ_END) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0;; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) break;
+        if (val == SEQ_WRONG) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        second_to_last = current_seq;
+        last = i;
+        last_val = val;
+        if (!pos_next(p, &current_seq, val))
+            return check_str_for_inval(s, length, i + 1) == -1 ? -1 : 0;
+    }
+
+    /*Only the parent changes, or the run holding the sequence, which
+    * is then the same node. Members of sequences which snapshots keep
+    * seeing are taken off their lists here.
+    */
+    if (p->snapshots) {
+        if (seq_own(p, s, last, &second_to_last) == -1) return -1;
+        current_seq = second_to_last;
+        pos_next(p, &current_seq, last_val);
+
+        uint32_t cut = current_seq.node;
+        if (current_seq.offset > 0) cut = seq_node(p, cut)->next[0];
+        if (cut && members_cut(p, cut) == -1) return -1;
+    }
+
+    seq_node_t * last_node = seq_node(p, current_seq.node);
+    if (p->concurrent) {
+        retired_collect(p);
+        if (retired_reserve(p, 1) == -1) return -1;
+        if (members_cut(p, current_seq.node) == -1) return -1;
+        pos_unlink(p, second_to_last, last_val);
+        subtree_drop(p, current_seq.node);
+    }
+    else if (current_seq.offset > 0) {
+        seq_remove_recur(p, last_node->next[0]);
+        run_set(last_node, current_seq.offset, run_values(last_node), 0);
+    }
+    else {
+        seq_remove_recur(p, current_seq.node);
+        pos_unlink(p, second_to_last, last_val);
+    }
+
+    __atomic_store_n(&p->generation, p->generation + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*Does remove_n, counted as SEQ_OP_REMOVE.*/
+int seq_remove_n(seq_t * p, char const * s, size_t length) {
+    SEQ_MEASURE(p, SEQ_OP_REMOVE, remove_n(p, s, length));
+}
+
+/*Deletes sequence s from structure and all sequences for which s is a prefix.*/
+int seq_remove(seq_t * p, char const * s) {
+    return seq_remove_n(p, s, SEQ_TERMINATED);
+}
+
+/*Frees all classes, members and names of table classes, leaving it empty.*/
+void classes_clear(seq_classes_t * classes) {
+    seq_names_t * names = &classes->names;
+    for (size_t i = 0; i < names->bucket_amount; i++) {
+        seq_name_t * name = names->buckets[i];
+        while (name) {
+            seq_name_t * next = name->next;
+            name_free(names, name);
+            name = next;
+        }
+    }
+    free(names->buckets);
+    names->buckets = NULL;
+    names->bucket_amount = 0;
+    names->amount = 0;
+    while (names->retired) {
+        seq_name_t * next = names->retired->next;
+        name_free(names, names->retired);
+        names->retired = next;
+    }
+    for (uint32_t m = 0; m < classes->member_amount; m++) {
+        seq_member_t * member = member_at(classes, m);
+        spare_free(&names->spare, member->text, member->length / 4 + 1);
+    }
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        if (classes->segments[i]) free(classes->segments[i]);
+        classes->segments[i] = NULL;
+        if (classes->member_segments[i]) free(classes->member_segments[i]);
+        classes->member_segments[i] = NULL;
+    }
+    classes->amount = 0;
+    classes->member_amount = 0;
+    classes->free_members = SEQ_NO_MEMBER;
+    classes->unknown = 0;
+    spare_clear(&names->spare);
+}
+
+/*Deletes whole storage and frees memory used by it.*/
+void seq_delete(seq_t * p) {
+    if (p && p->origin) {
+        snapshot_delete(p);
+        return;
+    }
+    if (p) {
+        if (p->sharding) shards_delete(p);
+        if (p->frozen) frozen_delete(p);
+        batch_free(p);
+        arena_clear(p);
+        if (p->mapping) {
+            munmap(p->mapping->base, p->mapping->size);
+            free(p->mapping);
+        }
+        classes_clear(&p->own_classes);
+        free(p->retired);
+        free(p->pools_block);
+        free(p);
+        p = NULL;
+    }
+}
+
+/*Checks if sequence s of given length is stored in storage p.*/
+int valid_n(seq_t * p, char const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) return shards_valid(p, s, length);
+    if (p->frozen) return frozen_valid(p, s, length);
+
+    if (p->concurrent) seq_read_begin();
+    seq_pos_t current_seq;
+    int found = seq_find(p, s, length, &current_seq);
+    if (p->concurrent) seq_read_end();
+    return found;
+}
+
+/*Does valid_n, counted as SEQ_OP_VALID.*/
+int seq_valid_n(seq_t * p, char const * s, size_t length) {
+    SEQ_MEASURE(p, SEQ_OP_VALID, valid_n(p, s, length));
+}
+
+/*Checks if sequence s is stored in storage p.*/
+int seq_valid(seq_t * p, char const * s) {
+    return seq_valid_n(p, s, SEQ_TERMINATED);
+}
+
+/*Checks which of n sequences from seqs, of lengths from lengths, are
+* stored in storage p. When lengths is NULL all sequences end with '\0'.
+* Result for sequence k, the same as from seq_valid_n, goes to results[k].
+*
+* Returns 0, or -1 and assigns EINVAL to errno if any sequence is illegal.
+*/
+int seq_valid_many(
+    seq_t * p, char const * const * seqs, size_t const * lengths,
+    size_t n, int * results
+    ) {
+    if (!p || (n > 0 && (!seqs || !results))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int answer = 0;
+    if (p->sharding || p->frozen) {
+        for (size_t k = 0; k < n; k++) {
+            results[k] = seq_valid_n(p, seqs[k], lengths ? lengths[k] : SEQ_TERMINATED);
+            if (results[k] == -1) answer = -1;
+        }
+        if (answer == -1) errno = EINVAL;
+        return answer;
+    }
+
+    if (p->concurrent) seq_read_begin();
+    for (size_t base = 0; base < n; base += SEQ_GROUP) {
+        size_t m = n - base < SEQ_GROUP ? n - base : SEQ_GROUP;
+        seq_pos_t pos[SEQ_GROUP];
+        find_group(p, seqs + base, lengths ? lengths + base : NULL, m,
+            results + base, pos);
+        for (size_t k = 0; k < m; k++)
+            if (results[base + k] == -1) answer = -1;
+    }
+    if (p->concurrent) seq_read_end();
+
+    if (answer == -1) errno = EINVAL;
+    return answer;
+}
+
+/*Packed sequences keep four values in each byte, two bits per value,
+* starting from the lowest bits of the first byte. Codes from SEQ_ALPHABET
+* on are illegal.
+*/
+
+/*Returns value number i of packed sequence s.*/
+static inline int packed_value(uint8_t const * s, size_t i) {
+    return (s[i >> 2] >> ((i & 3) * 2)) & 3;
+}
+
+/*Returns count (at most 32) values of packed sequence s of given length,
+* starting from value i, in the same layout as values of a run.
+*/
+static inline uint64_t packed_values(
+    uint8_t const * s, size_t length, size_t i, uint32_t count
+    ) {
+    size_t first = i >> 2;
+    size_t bytes = (length + 3) >> 2;
+    size_t amount = bytes - first < 8 ? bytes - first : 8;
+    uint64_t word = 0;
+
+    memcpy(&word, s + first, amount);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+
+    uint32_t shift = (uint32_t) (i & 3) * 2;
+    word >>= shift;
+    if (shift && first + 8 < bytes)
+        word |= (uint64_t) s[first + 8] << (64 - shift);
+    if (count < 32) word &= ((uint64_t) 1 << (2 * count)) - 1;
+    return word;
+}
+
+/*Tells whether word of packed values has one of SEQ_ALPHABET or more.*/
+static inline bool packed_illegal(uint64_t word) {
+#if SEQ_ALPHABET == 2
+    return word & 0xAAAAAAAAAAAAAAAAULL;
+#elif SEQ_ALPHABET == 3
+    return word & (word >> 1) & 0x5555555555555555ULL;
+#else
+    (void) word;
+    return false;
+#endif
+}
+
+/*Checks packed sequence s of given length a word at a time. For empty one
+* or one with illegal value returns -1 and assigns EINVAL to errno.
+*/
+int packed_check(uint8_t const * s, size_t length) {
+    if (!length) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < length; i += 32) {
+        uint32_t count = length - i < 32 ? (uint32_t) (length - i) : 32;
+        uint64_t word = packed_values(s, length, i, count);
+        if (packed_illegal(word)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*Walks from the root along correct packed sequence s of given length as far
+* as it is stored. Values inside runs are compared up to 32 at a time.
+* Leaves in pos the last position reached and returns how many values
+* were walked.
+*/
+size_t packed_walk(
+    seq_t const * p, uint8_t const * s, size_t length, seq_pos_t * pos
+    ) {
+    size_t i = 0;
+    pos->node = p->root;
+    pos->offset = 0;
+
+    while (i < length) {
+        seq_node_t const * current = seq_node(p, pos->node);
+        if (!node_is_run(current)) {
+            uint32_t son = node_son(current, packed_value(s, i));
+            if (!son) return i;
+            pos->node = son;
+            i++;
+            continue;
+        }
+
+        uint32_t length_run = run_length(current);
+        uint32_t ahead = length_run - pos->offset - (current->next[0] ? 0 : 1);
+        if (!ahead) return i;
+
+        uint32_t count = length - i < ahead ? (uint32_t) (length - i) : ahead;
+        uint64_t differ = (run_values(current) >> (2 * pos->offset))
+            ^ packed_values(s, length, i, count);
+        if (count < 32) differ &= ((uint64_t) 1 << (2 * count)) - 1;
+
+        if (differ) {
+            uint32_t same = (uint32_t) __builtin_ctzll(differ) / 2;
+            pos->offset += same;
+            return i + same;
+        }
+
+        i += count;
+        pos->offset += count;
+        if (pos->offset == length_run) {
+            pos->node = current->next[0];
+            pos->offset = 0;
+        }
+    }
+    return i;
+}
+
+/*Same as chain_new for correct packed sequence s,
+* runs get their values straight from s.
+*/
+uint32_t packed_chain_new(
+    seq_t * p, uint8_t const * s, size_t length, size_t i
+    ) {
+    uint32_t first = 0;
+    uint32_t last = 0;
+
+    while (i < length) {
+        uint32_t node = arena_node(p);
+        if (!node) {
+            seq_remove_recur(p, first);
+            return 0;
+        }
+
+        if (last) {
+            seq_node_t * previous = seq_node(p, last);
+            if (node_is_run(previous)) previous->next[0] = node;
+            else previous->next[packed_value(s, i)] = node;
+        }
+        else {
+            first = node;
+        }
+        last = node;
+
+        if (p->compressed) {
+            uint32_t count = length - i < SEQ_RUN_MAX ? (uint32_t) (length - i) : SEQ_RUN_MAX;
+            uint32_t known = i + count < length ? count : count - 1;
+            uint64_t values = known ? packed_values(s, length, i + 1, known) : 0;
+            run_set(seq_node(p, node), count, values, 0);
+            i += count;
+        }
+        else {
+            i++;
+        }
+    }
+
+    return first;
+}
+
+/*Unpacks correct packed sequence s of given length into characters
+* and calls call on them, which is how sharded storages take packed ones.
+*/
+int packed_call(
+    seq_t * p, uint8_t const * s, size_t length,
+    int (*call)(seq_t *, char const *, size_t)
+    ) {
+    char * unpacked = (char *) malloc(length ? length : 1);
+    if (!unpacked) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++) unpacked[i] = seq_symbol(packed_value(s, i));
+
+    int answer = call(p, unpacked, length);
+    free(unpacked);
+    return answer;
+}
+
+/*Adds to storage packed sequence s of given number of values
+* and all of its prefixes.
+*/
+int seq_add_packed(seq_t * p, uint8_t const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (packed_check(s, length) == -1) return -1;
+    if (p->sharding) return packed_call(p, s, length, seq_add_n);
+    if (storage_write(p) == -1) return -1;
+    if (p->snapshots) return packed_call(p, s, length, seq_add_n);
+
+    for (;;) {
+        seq_pos_t current_seq;
+        size_t i = packed_walk(p, s, length, &current_seq);
+        if (i == length) return 0;
+
+        uint32_t first_added_seq = packed_chain_new(p, s, length, i);
+        if (!first_added_seq) return -1;
+
+        if (pos_split(p, &current_seq) == -1) {
+            seq_remove_recur(p, first_added_seq);
+            return -1;
+        }
+
+        if (pos_attach(p, current_seq, packed_value(s, i), first_added_seq))
+            return 1;
+
+        /*Another thread added this son first, walk again.*/
+        seq_remove_recur(p, first_added_seq);
+    }
+}
+
+/*Checks if packed sequence s of given number of values is stored in storage p.*/
+int seq_valid_packed(seq_t * p, uint8_t const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (packed_check(s, length) == -1) return -1;
+    if (p->sharding || p->frozen) return packed_call(p, s, length, seq_valid_n);
+
+    if (p->concurrent) seq_read_begin();
+    seq_pos_t current_seq;
+    int found = packed_walk(p, s, length, &current_seq) == length;
+    if (p->concurrent) seq_read_end();
+    return found;
+}
+
+/*Polynomial hash of text made of n1_length first characters of n1
+* followed by n2_length first characters of n2, counted modulo 2^64.
+*/
+size_t name_hash(
+    char const * n1, size_t n1_length, char const * n2, size_t n2_length
+    ) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < n1_length; i++)
+        hash = hash * SEQ_NAME_BASE + (unsigned char) n1[i];
+    for (size_t i = 0; i < n2_length; i++)
+        hash = hash * SEQ_NAME_BASE + (unsigned char) n2[i];
+    return (size_t) hash;
+}
+
+/*Returns SEQ_NAME_BASE to the power length, modulo 2^64.*/
+uint64_t name_power(size_t length) {
+    uint64_t power = 1;
+    uint64_t square = SEQ_NAME_BASE;
+    for (; length > 0; length >>= 1) {
+        if (length & 1) power *= square;
+        square *= square;
+    }
+    return power;
+}
+
+/*Returns bucket for names with given hash among amount buckets.
+* Lowest bits of polynomial hashes are poorly mixed, so they are mixed first.
+*/
+static inline size_t name_bucket(size_t hash, size_t amount) {
+    uint64_t mixed = ((uint64_t) hash ^ ((uint64_t) hash >> 29)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (mixed >> 32) & (amount - 1);
+}
+
+/*Returns how many units a block of given size takes in spare memory.*/
+static inline size_t spare_units(size_t bytes) {
+    return (bytes + SEQ_SPARE_UNIT - 1) / SEQ_SPARE_UNIT;
+}
+
+/*Returns block of given size, from spare memory if it has one.
+* In case of allocation error returns NULL and assigns ENOMEM to errno.
+*/
+void * spare_alloc(seq_spare_t * spare, size_t bytes) {
+    size_t units = spare_units(bytes);
+    if (units <= SEQ_SPARE_CLASSES) {
+        void * block = spare->free[units - 1];
+        if (block) {
+            spare->free[units - 1] = *(void **) block;
+            return block;
+        }
+        if ((size_t) (spare->end - spare->next) >= units * SEQ_SPARE_UNIT) {
+            block = spare->next;
+            spare->next += units * SEQ_SPARE_UNIT;
+            return block;
+        }
+    }
+
+    void * block = malloc(bytes);
+    if (!block) errno = ENOMEM;
+    else spare->fallbacks++;
+    return block;
+}
+
+/*Returns how many regions of spare start below address.*/
+static inline size_t spare_below(seq_spare_t const * spare, uintptr_t address) {
+    size_t low = 0;
+    size_t high = spare->region_amount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if ((uintptr_t) spare->regions[middle] < address) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/*Tells whether block was cut from a region of spare.*/
+static inline bool spare_owns(seq_spare_t const * spare, void const * block) {
+    uintptr_t address = (uintptr_t) block;
+    size_t below = spare_below(spare, address);
+    return below > 0 && address < (uintptr_t) spare->regions[below - 1]->end;
+}
+
+/*Gives back block of given size made by spare_alloc, NULL is ignored.
+* Spare blocks are kept for later, others are freed.
+*/
+void spare_free(seq_spare_t * spare, void * block, size_t bytes) {
+    if (!block) return;
+    if (!spare_owns(spare, block)) {
+        free(block);
+        return;
+    }
+
+    size_t units = spare_units(bytes);
+    *(void **) block = spare->free[units - 1];
+    spare->free[units - 1] = block;
+}
+
+/*Puts aside memory for blocks of bytes bytes together, unless the newest
+* region still has that much. What is left of it is cut into blocks
+* waiting on free lists.
+*
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int spare_grow(seq_spare_t * spare, size_t bytes) {
+    if ((size_t) (spare->end - spare->next) >= bytes) return 0;
+
+    size_t units = spare_units(bytes);
+    if (units > (SIZE_MAX - sizeof(seq_spare_region_t)) / SEQ_SPARE_UNIT) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (spare->region_amount == spare->region_capacity) {
+        size_t capacity = spare->region_capacity ? 2 * spare->region_capacity : 8;
+        seq_spare_region_t ** regions = (seq_spare_region_t **) realloc(
+            spare->regions, sizeof(seq_spare_region_t *) * capacity
+        );
+        if (!regions) {
+            errno = ENOMEM;
+            return -1;
+        }
+        spare->regions = regions;
+        spare->region_capacity = capacity;
+    }
+    seq_spare_region_t * region = (seq_spare_region_t *) malloc(
+        sizeof(seq_spare_region_t) + units * SEQ_SPARE_UNIT
+    );
+    if (!region) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (spare->next < spare->end) {
+        size_t left = (size_t) (spare->end - spare->next) / SEQ_SPARE_UNIT;
+        if (left > SEQ_SPARE_CLASSES) left = SEQ_SPARE_CLASSES;
+        *(void **) spare->next = spare->free[left - 1];
+        spare->free[left - 1] = spare->next;
+        spare->next += left * SEQ_SPARE_UNIT;
+    }
+
+    region->end = (char *) (region + 1) + units * SEQ_SPARE_UNIT;
+    size_t below = spare_below(spare, (uintptr_t) region);
+    memmove(spare->regions + below + 1, spare->regions + below,
+        sizeof(seq_spare_region_t *) * (spare->region_amount - below));
+    spare->regions[below] = region;
+    spare->region_amount++;
+    spare->next = (char *) (region + 1);
+    spare->end = region->end;
+    return 0;
+}
+
+/*Frees all regions of spare, whose blocks must not be used any more.*/
+void spare_clear(seq_spare_t * spare) {
+    for (size_t i = 0; i < spare->region_amount; i++) free(spare->regions[i]);
+    free(spare->regions);
+    spare->regions = NULL;
+    spare->region_amount = 0;
+    spare->region_capacity = 0;
+    spare->next = NULL;
+    spare->end = NULL;
+    for (uint32_t i = 0; i < SEQ_SPARE_CLASSES; i++) spare->free[i] = NULL;
+}
+
+/*Makes the table twice as big. Table stays as it was if there is
+* no memory for the bigger one, names are only found slower then.
+*/
+void names_grow(seq_names_t * names) {
+    size_t new_amount = names->bucket_amount ? 2 * names->bucket_amount : 16;
+    seq_name_t ** new_buckets =
+        (seq_name_t **) calloc(new_amount, sizeof(seq_name_t *));
+    if (!new_buckets) return;
+
+    for (size_t i = 0; i < names->bucket_amount; i++) {
+        seq_name_t * name = names->buckets[i];
+        while (name) {
+            seq_name_t * next = name->next;
+            size_t bucket = name_bucket(name->hash, new_amount);
+            name->next = new_buckets[bucket];
+            new_buckets[bucket] = name;
+            name = next;
+        }
+    }
+
+    free(names->buckets);
+    names->buckets = new_buckets;
+    names->bucket_amount = new_amount;
+}
+
+/*Returns whole text of name, making it first if name is a join.
+* Readers of concurrent storage may do it together, only one text is kept.
+*
+* In case of allocation error returns NULL and assigns ENOMEM to errno.
+*/
+char const * name_text(seq_name_t * name) {
+    char * flat = __atomic_load_n(&name->flat, __ATOMIC_ACQUIRE);
+    if (flat) return flat;
+
+    flat = (char *) malloc(name->length + 1);
+    seq_name_t ** stack =
+        (seq_name_t **) malloc(sizeof(seq_name_t *) * ((size_t) name->depth + 1));
+    if (!flat || !stack) {
+        free(flat);
+        free(stack);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t written = 0;
+    size_t amount = 0;
+    stack[amount++] = name;
+    while (amount > 0) {
+        seq_name_t * current = stack[--amount];
+        char const * part = __atomic_load_n(&current->flat, __ATOMIC_ACQUIRE);
+        if (part) {
+            memcpy(flat + written, part, current->length);
+            written += current->length;
+            continue;
+        }
+        stack[amount++] = current->right;
+        stack[amount++] = current->left;
+    }
+    flat[name->length] = '\0';
+    free(stack);
+
+    char * expected = NULL;
+    if (!__atomic_compare_exchange_n(&name->flat, &expected, flat, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(flat);
+        return expected;
+    }
+    return flat;
+}
+
+/*Adds name to its bucket of the table, with one reference of the caller.*/
+void name_insert(seq_names_t * names, seq_name_t * name) {
+    size_t bucket = name_bucket(name->hash, names->bucket_amount);
+    name->references = 1;
+    name->retired = 0;
+    name->next = names->buckets[bucket];
+    names->buckets[bucket] = name;
+    names->amount++;
+}
+
+/*Returns name made of n1 followed by n2 (which may be empty) from the table,
+* adding it if it is not there yet. Caller becomes one of name's references.
+*
+* In case of allocation error returns NULL and assigns ENOMEM to errno.
+*/
+seq_name_t * name_get(
+    seq_names_t * names, char const * n1, size_t n1_length,
+    char const * n2, size_t n2_length
+    ) {
+    size_t length = n1_length + n2_length;
+    size_t hash = name_hash(n1, n1_length, n2, n2_length);
+
+    if (names->amount >= names->bucket_amount) names_grow(names);
+    if (!names->bucket_amount) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t bucket = name_bucket(hash, names->bucket_amount);
+    for (seq_name_t * name = names->buckets[bucket]; name; name = name->next) {
+        if (name->hash != hash || name->length != length) continue;
+
+        char const * text = name_text(name);
+        if (!text) return NULL;
+        if (!memcmp(text, n1, n1_length) && !memcmp(text + n1_length, n2, n2_length)) {
+            name->references++;
+            return name;
+        }
+    }
+
+    seq_name_t * name = (seq_name_t *) spare_alloc(
+        &names->spare, sizeof(seq_name_t) + sizeof(char) * (length + 1)
+    );
+    if (!name) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(name->text, n1, n1_length);
+    memcpy(name->text + n1_length, n2, n2_length);
+    name->text[length] = '\0';
+    name->hash = hash;
+    name->length = length;
+    name->power = name_power(length);
+    name->left = NULL;
+    name->right = NULL;
+    name->flat = name->text;
+    name->depth = 0;
+    name_insert(names, name);
+
+    return name;
+}
+
+/*Returns name made of n1 followed by n2 from the table, adding it as a join
+* if it is not there yet, which takes constant time. Caller becomes one
+* of name's references.
+*
+* In case of allocation error returns NULL and assigns ENOMEM to errno.
+*/
+seq_name_t * name_join(seq_names_t * names, seq_name_t * n1, seq_name_t * n2) {
+    size_t length = n1->length + n2->length;
+    size_t hash = (size_t) ((uint64_t) n1->hash * n2->power + (uint64_t) n2->hash);
+
+    if (names->amount >= names->bucket_amount) names_grow(names);
+    if (!names->bucket_amount) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /*Names with the same hash are almost always the same text,
+    * texts are only compared to be sure.
+    */
+    size_t bucket = name_bucket(hash, names->bucket_amount);
+    for (seq_name_t * name = names->buckets[bucket]; name; name = name->next) {
+        if (name->hash != hash || name->length != length) continue;
+        if (name->left != n1 || name->right != n2) {
+            char const * text = name_text(name);
+            char const * text_1 = text ? name_text(n1) : NULL;
+            char const * text_2 = text_1 ? name_text(n2) : NULL;
+            if (!text_2) return NULL;
+            if (memcmp(text, text_1, n1->length)
+                || memcmp(text + n1->length, text_2, n2->length)) continue;
+        }
+        name->references++;
+        return name;
+    }
+
+    seq_name_t * name =
+        (seq_name_t *) spare_alloc(&names->spare, sizeof(seq_name_t) + sizeof(char));
+    if (!name) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    name->text[0] = '\0';
+    name->hash = hash;
+    name->length = length;
+    name->power = n1->power * n2->power;
+    name->left = n1;
+    name->right = n2;
+    name->flat = NULL;
+    name->depth = 1 + (n1->depth > n2->depth ? n1->depth : n2->depth);
+    n1->references++;
+    n2->references++;
+    name_insert(names, name);
+
+    return name;
+}
+
+void name_free(seq_names_t * names, seq_name_t * name) {
+    if (name->flat != name->text) free(name->flat);
+    size_t length = name->left ? 0 : name->length;
+    spare_free(&names->spare, name, sizeof(seq_name_t) + sizeof(char) * (length + 1));
+}
+
+/*Takes name with no references out of its bucket.*/
+static inline void name_unlink(seq_names_t * names, seq_name_t * name) {
+    seq_name_t ** current =
+        &names->buckets[name_bucket(name->hash, names->bucket_amount)];
+    while (*current != name) current = &(*current)->next;
+    *current = name->next;
+    names->amount--;
+}
+
+/*Drops one reference of name and frees it if it was the last one,
+* together with parts of joins which are not used any more. Names waiting
+* to be freed are linked through next, so joins of any depth are freed
+* without recursion.
+*/
+void name_release(seq_names_t * names, seq_name_t * name) {
+    if (--name->references > 0) return;
+    name_unlink(names, name);
+    name->next = NULL;
+
+    seq_name_t * waiting = name;
+    while (waiting) {
+        seq_name_t * current = waiting;
+        waiting = current->next;
+
+        if (names->deferred) {
+            current->retired = epoch_retire();
+            current->next = names->retired;
+            names->retired = current;
+            continue;
+        }
+
+        seq_name_t * parts[2] = {current->left, current->right};
+        for (int i = 0; i < 2; i++) {
+            if (!parts[i] || --parts[i]->references > 0) continue;
+            name_unlink(names, parts[i]);
+            parts[i]->next = waiting;
+            waiting = parts[i];
+        }
+        name_free(names, current);
+    }
+}
+
+/*Makes segment holding class abs_class the own one of table classes,
+* copying it if it is shared with snapshots. Copy holds one more reference
+* of each name in it.
+*
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int class_own(seq_classes_t * classes, int abs_class) {
+    uint32_t segment = class_segment((uint32_t) abs_class);
+    seq_share_t * share = classes->shares[segment];
+    if (!share) return 0;
+
+    seq_class_t * copy = (seq_class_t *) malloc(
+        sizeof(seq_class_t) * (SEQ_SEGMENT_MIN_CLASSES << segment)
+    );
+    if (!copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    classes->names.spare.fallbacks++;
+    memcpy(copy, classes->segments[segment], sizeof(seq_class_t) * share->used);
+    for (uint32_t i = 0; i < share->used; i++)
+        if (copy[i].name) copy[i].name->references++;
+
+    share->references--;
+    classes->segments[segment] = copy;
+    classes->shares[segment] = NULL;
+    return 0;
+}
+
+/*Adds new abstraction class without name to the table and returns its number.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int class_new(seq_classes_t * classes) {
+    int abs_class = classes->amount;
+    uint32_t segment = class_segment((uint32_t) abs_class);
+
+    if (abs_class == INT32_MAX || segment >= SEQ_SEGMENTS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (class_own(classes, abs_class) == -1) return -1;
+    if (!classes->segments[segment]) {
+        classes->segments[segment] = (seq_class_t *) malloc(
+            sizeof(seq_class_t) * (SEQ_SEGMENT_MIN_CLASSES << segment)
+        );
+        if (!classes->segments[segment]) {
+            errno = ENOMEM;
+            return -1;
+        }
+        classes->names.spare.fallbacks++;
+    }
+
+    seq_class_t * new_class = class_at(classes, abs_class);
+    new_class->parent = abs_class;
+    new_class->rank = 0;
+    new_class->name = NULL;
+    new_class->members = SEQ_NO_MEMBER;
+    classes->amount++;
+
+    return abs_class;
+}
+
+/*Returns representative of abstraction class abs_class.
+* Every class met on the way is attached directly to the representative,
+* unless its segment is shared with snapshots.
+*/
+int class_find(seq_classes_t * classes, int abs_class) {
+    int representative = abs_class;
+
+    while (class_at(classes, representative)->parent != representative)
+        representative = class_at(classes, representative)->parent;
+
+    while (class_at(classes, abs_class)->parent != representative) {
+        seq_class_t * current = class_at(classes, abs_class);
+        int next = current->parent;
+        if (!classes->shares[class_segment((uint32_t) abs_class)])
+            __atomic_store_n(&current->parent, representative, __ATOMIC_RELEASE);
+        abs_class = next;
+    }
+
+    return representative;
+}
+
+/*Returns representative of abstraction class abs_class without changing
+* the table, so that it can be used by readers of concurrent storage.
+*/
+int class_root(seq_classes_t const * classes, int abs_class) {
+    for (;;) {
+        int parent = __atomic_load_n(
+            &class_at(classes, abs_class)->parent, __ATOMIC_ACQUIRE
+        );
+        if (parent == abs_class) return abs_class;
+        abs_class = parent;
+    }
+}
+
+/*Returns name of the class with representative abs_class, if it has one.*/
+static inline seq_name_t * class_read_name(seq_classes_t const * classes, int abs_class) {
+    return __atomic_load_n(&class_at(classes, abs_class)->name, __ATOMIC_ACQUIRE);
+}
+
+/*Returns representative of abstraction class abs_class of storage p,
+* leaving the table as it is in concurrent storages.
+*/
+static inline int class_lookup(seq_t * p, int abs_class) {
+    if (p->concurrent) return class_root(p->classes, abs_class);
+    return class_find(p->classes, abs_class);
+}
+
+/*Returns name of abstraction class abs_class of storage p, if it has one.
+*
+* Merging clears the name of the class which stops being a representative,
+* so a reader of concurrent storage that finds it before the merge may load
+* NULL there. Name is taken only from a class which is still a representative
+* after it is loaded, otherwise the walk goes on from that class.
+*/
+static inline seq_name_t * class_root_name(seq_t * p, int abs_class) {
+    if (!p->concurrent) return class_read_name(p->classes, class_find(p->classes, abs_class));
+
+    for (;;) {
+        int root = class_root(p->classes, abs_class);
+        seq_name_t * class_name = class_read_name(p->classes, root);
+        int parent = __atomic_load_n(&class_at(p->classes, root)->parent, __ATOMIC_ACQUIRE);
+        if (parent == root) return class_name;
+        abs_class = parent;
+    }
+}
+
+/*Returns text of the name of abstraction class abs_class of storage p,
+* NULL if it has none. Storage opened from a snapshot file reads it
+* from the file until it is first changed.
+*
+* In case of allocation error returns NULL and assigns ENOMEM to errno.
+*/
+static inline char const * class_text(seq_t * p, int abs_class) {
+    seq_mapping_t const * mapping = p->mapping;
+    if (mapping && mapping->classes) {
+        uint64_t name = mapping->classes[mapping->classes[abs_class].parent].name;
+        return name == SEQ_SNAP_NO_NAME ? NULL : mapping->names + name;
+    }
+
+    seq_name_t * class_name = class_root_name(p, abs_class);
+    return class_name ? name_text(class_name) : NULL;
+}
+
+/*Prefetches record of abstraction class abs_class of storage p.*/
+static inline void class_prefetch(seq_t const * p, int abs_class) {
+    seq_mapping_t const * mapping = p->mapping;
+    if (mapping && mapping->classes) __builtin_prefetch(&mapping->classes[abs_class]);
+    else __builtin_prefetch(class_at(p->classes, abs_class));
+}
+
+/*Gives name to the class with representative abs_class.*/
+static inline void class_set_name(
+    seq_classes_t * classes, int abs_class, seq_name_t * name
+    ) {
+    __atomic_store_n(&class_at(classes, abs_class)->name, name, __ATOMIC_RELEASE);
+}
+
+/*Merges classes with representatives abs_class_1 and abs_class_2
+* and returns representative of the merged class.
+*/
+int class_union(seq_classes_t * classes, int abs_class_1, int abs_class_2) {
+    seq_class_t * class_1 = class_at(classes, abs_class_1);
+    seq_class_t * class_2 = class_at(classes, abs_class_2);
+
+    if (class_1->rank < class_2->rank) {
+        __atomic_store_n(&class_1->parent, abs_class_2, __ATOMIC_RELEASE);
+        return abs_class_2;
+    }
+
+    __atomic_store_n(&class_2->parent, abs_class_1, __ATOMIC_RELEASE);
+    if (class_1->rank == class_2->rank) class_1->rank++;
+    return abs_class_1;
+}
+
+/*Returns class which member number m of storage p was put in.
+* Storage opened from a snapshot file reads it from the file until
+* it is first changed.
+*/
+static inline int32_t member_class(seq_t const * p, int32_t m) {
+    seq_mapping_t const * mapping = p->mapping;
+    if (mapping && mapping->classes) return mapping->members[m].abs_class;
+    return member_at(p->classes, (uint32_t) m)->abs_class;
+}
+
+/*Adds member of class with representative abs_class to table classes
+* and returns its number. Sequence of the member is s of given length,
+* when s is NULL it is not known.
+*
+* In case of allocation error returns SEQ_NO_MEMBER and assigns ENOMEM
+* to errno.
+*/
+uint32_t member_new(
+    seq_classes_t * classes, int abs_class, char const * s, size_t length
+    ) {
+    uint8_t * text = NULL;
+    if (s) {
+        length = seq_scan(s, length, 0);
+        text = (uint8_t *) spare_alloc(&classes->names.spare, length / 4 + 1);
+        if (!text) return SEQ_NO_MEMBER;
+        memset(text, 0, length / 4 + 1);
+        for (size_t i = 0; i < length; i++)
+            text[i / 4] |= (uint8_t) (seq_value(s[i]) << (2 * (i % 4)));
+    }
+
+    uint32_t m = classes->free_members;
+    if (m != SEQ_NO_MEMBER) {
+        classes->free_members = member_at(classes, m)->next;
+    }
+    else {
+        m = classes->member_amount;
+        uint32_t segment = class_segment(m);
+        if (m == SEQ_NO_MEMBER || segment >= SEQ_SEGMENTS) {
+            spare_free(&classes->names.spare, text, length / 4 + 1);
+            errno = ENOMEM;
+            return SEQ_NO_MEMBER;
+        }
+        if (!classes->member_segments[segment]) {
+            classes->member_segments[segment] = (seq_member_t *) malloc(
+                sizeof(seq_member_t) * (SEQ_SEGMENT_MIN_CLASSES << segment)
+            );
+            if (!classes->member_segments[segment]) {
+                spare_free(&classes->names.spare, text, length / 4 + 1);
+                errno = ENOMEM;
+                return SEQ_NO_MEMBER;
+            }
+            classes->names.spare.fallbacks++;
+        }
+        classes->member_amount++;
+    }
+
+    seq_member_t * member = member_at(classes, m);
+    member->text = text;
+    member->length = s ? length : 0;
+    member->abs_class = abs_class;
+    member->references = 0;
+    if (!text) classes->unknown++;
+
+    seq_class_t * owner = class_at(classes, abs_class);
+    if (owner->members == SEQ_NO_MEMBER) {
+        member->next = m;
+        member->prev = m;
+        owner->members = m;
+    }
+    else {
+        seq_member_t * first = member_at(classes, owner->members);
+        member->next = owner->members;
+        member->prev = first->prev;
+        member_at(classes, first->prev)->next = m;
+        first->prev = m;
+    }
+    return m;
+}
+
+/*Takes member m off the list of its class.*/
+void member_unlink(seq_classes_t * classes, uint32_t m) {
+    seq_member_t * member = member_at(classes, m);
+    seq_class_t * owner = class_at(classes, class_find(classes, member->abs_class));
+
+    if (member->next == m) {
+        owner->members = SEQ_NO_MEMBER;
+    }
+    else {
+        member_at(classes, member->prev)->next = member->next;
+        member_at(classes, member->next)->prev = member->prev;
+        if (owner->members == m) owner->members = member->next;
+    }
+    member->next = SEQ_NO_MEMBER;
+    member->prev = SEQ_NO_MEMBER;
+}
+
+void member_free(seq_classes_t * classes, uint32_t m) {
+    seq_member_t * member = member_at(classes, m);
+    if (member->references > 0) {
+        member->references--;
+        return;
+    }
+    if (member->prev != SEQ_NO_MEMBER) member_unlink(classes, m);
+    if (!member->text) classes->unknown--;
+
+    spare_free(&classes->names.spare, member->text, member->length / 4 + 1);
+    member->text = NULL;
+    member->abs_class = -1;
+    member->next = classes->free_members;
+    classes->free_members = m;
+}
+
+/*Appends members of class with representative abs_class_2 to members
+* of class with representative abs_class_1. Lists are circular,
+* so they are joined in constant time whatever their lengths.
+*/
+void members_splice(seq_classes_t * classes, int abs_class_1, int abs_class_2) {
+    seq_class_t * class_1 = class_at(classes, abs_class_1);
+    seq_class_t * class_2 = class_at(classes, abs_class_2);
+    uint32_t first_1 = class_1->members;
+    uint32_t first_2 = class_2->members;
+    class_2->members = SEQ_NO_MEMBER;
+
+    if (first_2 == SEQ_NO_MEMBER) return;
+    if (first_1 == SEQ_NO_MEMBER) {
+        class_1->members = first_2;
+        return;
+    }
+
+    uint32_t last_1 = member_at(classes, first_1)->prev;
+    uint32_t last_2 = member_at(classes, first_2)->prev;
+    member_at(classes, last_1)->next = first_2;
+    member_at(classes, first_2)->prev = last_1;
+    member_at(classes, last_2)->next = first_1;
+    member_at(classes, first_1)->prev = last_2;
+}
+
+/*Takes members of sequences in subtree starting at node of storage p
+* off the lists of their classes. Records themselves are given back
+* together with the nodes, when subtree cut off from concurrent storage
+* is freed. In case of allocation error returns -1, assigns ENOMEM
+* to errno and changes nothing.
+*/
+int members_cut(seq_t * p, uint32_t node) {
+    seq_classes_t * classes = p->classes;
+    if (classes->member_amount == 0) return 0;
+
+    size_t amount = 1;
+    size_t capacity = 64;
+    uint32_t * nodes = (uint32_t *) malloc(sizeof(uint32_t) * capacity);
+    if (!nodes) {
+        errno = ENOMEM;
+        return -1;
+    }
+    nodes[0] = node;
+
+    for (size_t k = 0; k < amount; k++) {
+        if (amount + SEQ_ALPHABET > capacity) {
+            uint32_t * grown =
+                (uint32_t *) realloc(nodes, sizeof(uint32_t) * 2 * capacity);
+            if (!grown) {
+                free(nodes);
+                errno = ENOMEM;
+                return -1;
+            }
+            nodes = grown;
+            capacity *= 2;
+        }
+
+        seq_node_t const * current = seq_node(p, nodes[k]);
+        int sons = node_is_run(current) ? 1 : SEQ_ALPHABET;
+        for (int val = 0; val < sons; val++)
+            if (current->next[val]) nodes[amount++] = current->next[val];
+    }
+
+    for (size_t k = 0; k < amount; k++) {
+        seq_node_t const * current = seq_node(p, nodes[k]);
+        if (!node_is_run(current) && current->abstract_class >= 0)
+            member_unlink(classes, (uint32_t) current->abstract_class);
+    }
+    free(nodes);
+    return 0;
+}
+
+/*Node met by members_resolve: its first sequence is of given length
+* and ends with value.
+*/
+typedef struct seq_resolve_step {
+    uint32_t node;
+    int value;
+    size_t length;
+} seq_resolve_step_t;
+
+/*Finds sequences of all members of storage p which do not know them,
+* going through the tree once with the path to the current node.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int members_resolve(seq_t * p) {
+    seq_classes_t * classes = p->classes;
+    size_t amount = 1;
+    size_t capacity = 64;
+    size_t path_capacity = 64;
+    seq_resolve_step_t * steps =
+        (seq_resolve_step_t *) malloc(sizeof(seq_resolve_step_t) * capacity);
+    char * path = (char *) malloc(path_capacity);
+    bool failed = !steps || !path;
+
+    if (steps) {
+        steps[0].node = 0;
+        steps[0].value = 0;
+        steps[0].length = 0;
+    }
+
+    while (!failed && classes->unknown > 0 && amount > 0) {
+        seq_resolve_step_t step = steps[--amount];
+        seq_node_t const * current = seq_node(p, step.node);
+        uint32_t run = node_is_run(current) ? run_length(current) : 0;
+
+        if (step.length + run >= path_capacity) {
+            size_t new_capacity = 2 * path_capacity;
+            while (step.length + run >= new_capacity) new_capacity *= 2;
+            char * grown = (char *) realloc(path, new_capacity);
+            if (!grown) {
+                failed = true;
+                break;
+            }
+            path = grown;
+            path_capacity = new_capacity;
+        }
+        if (amount + SEQ_ALPHABET > capacity) {
+            seq_resolve_step_t * grown = (seq_resolve_step_t *) realloc(
+                steps, sizeof(seq_resolve_step_t) * 2 * capacity
+            );
+            if (!grown) {
+                failed = true;
+                break;
+            }
+            steps = grown;
+            capacity *= 2;
+        }
+        if (step.length > 0) path[step.length - 1] = seq_symbol(step.value);
+
+        if (run) {
+            for (uint32_t i = 0; i + 1 < run; i++)
+                path[step.length + i] = seq_symbol(run_value(current, i));
+            if (current->next[0]) {
+                steps[amount].node = current->next[0];
+                steps[amount].value = run_value(current, run - 1);
+                steps[amount].length = step.length + run;
+                amount++;
+            }
+            continue;
+        }
+
+        if (current->abstract_class >= 0) {
+            seq_member_t * member =
+                member_at(classes, (uint32_t) current->abstract_class);
+            if (!member->text) {
+                uint8_t * text = (uint8_t *) calloc(step.length / 4 + 1, 1);
+                if (!text) {
+                    failed = true;
+                    break;
+                }
+                for (size_t i = 0; i < step.length; i++)
+                    text[i / 4] |= (uint8_t) (seq_value(path[i]) << (2 * (i % 4)));
+                member->text = text;
+                member->length = step.length;
+                classes->unknown--;
+            }
+        }
+
+        for (int val = SEQ_ALPHABET - 1; val >= 0; val--) {
+            if (!current->next[val]) continue;
+            steps[amount].node = current->next[val];
+            steps[amount].value = val;
+            steps[amount].length = step.length + 1;
+            amount++;
+        }
+    }
+
+    free(steps);
+    free(path);
+    if (failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/*Renames abstraction class with representative abs_class to n
+* of given length. Only the class record is touched, every sequence
+* of the class sees the new name through its representative.
+*
+* Returns 0 if class already has this name, 1 if name was changed.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int class_rename(
+    seq_classes_t * classes, int abs_class, char const * n, size_t n_length
+    ) {
+    if (class_own(classes, abs_class) == -1) return -1;
+    seq_name_t * current_name = class_at(classes, abs_class)->name;
+
+    /*Names are kept once in the table, so equal names are the same one.*/
+    seq_name_t * new_name = name_get(&classes->names, n, n_length, "", 0);
+    if (!new_name) return -1;
+    if (new_name == current_name) {
+        name_release(&classes->names, new_name);
+        return 0;
+    }
+
+    class_set_name(classes, abs_class, new_name);
+    if (current_name) name_release(&classes->names, current_name);
+    return 1;
+}
+
+/*Changes name of sequence at position pos to n of length n_length,
+* cutting a run if pos is inside one. The sequence is s of given length,
+* NULL if it is not known. Returns the same as seq_set_name.
+*/
+int pos_set_name(
+    seq_t * p, seq_pos_t * pos, char const * s, size_t length,
+    char const * n, size_t n_length
+    ) {
+    if (storage_write(p) == -1) return -1;
+    if (p->concurrent) retired_collect(p);
+    if (pos_split(p, pos) == -1) return -1;
+
+    seq_classes_t * classes = p->classes;
+    seq_node_t * current_node = seq_node(p, pos->node);
+    if (current_node->abstract_class != -1) {
+        seq_member_t const * member =
+            member_at(classes, (uint32_t) current_node->abstract_class);
+        int current_abs_class = class_find(classes, member->abs_class);
+        return class_rename(classes, current_abs_class, n, n_length);
+    }
+
+    int new_abs_class = class_new(classes);
+    if (new_abs_class == -1) return -1;
+
+    uint32_t member = member_new(classes, new_abs_class, s, length);
+    if (member == SEQ_NO_MEMBER) {
+        classes->amount--;
+        return -1;
+    }
+    if (class_rename(classes, new_abs_class, n, n_length) == -1) {
+        member_free(classes, member);
+        classes->amount--;
+        return -1;
+    }
+    node_set_class(current_node, (int32_t) member);
+    return 1;
+}
+
+/*Changes name of sequence s of given length to n. Switches to this name
+* for every sequence in the same abstraction class.
+*/
+int set_name_n(seq_t * p, char const * s, size_t length, char const * n) {
+    if (!p || !s || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    seq_pos_t current_seq;
+    size_t n_length = strlen(n);
+    
+    if (!n_length) {    
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) return shards_set_name(p, s, length, n);
+    if (p->frozen || p->origin) {
+        errno = EPERM;
+        return -1;
+    }
+
+    int found = seq_find(p, s, length, &current_seq);
+    if (found != 1) return found;
+    if (p->snapshots && seq_own(p, s, length, &current_seq) == -1) return -1;
+    return pos_set_name(p, &current_seq, s, length, n, n_length);
+}
+
+/*Does set_name_n, counted as SEQ_OP_SET_NAME.*/
+int seq_set_name_n(seq_t * p, char const * s, size_t length, char const * n) {
+    SEQ_MEASURE(p, SEQ_OP_SET_NAME, set_name_n(p, s, length, n));
+}
+
+/*Changes sequence s's name to n. Switches to this name for every sequence
+* in the same abstraction class.
+*/
+int seq_set_name(seq_t * p, char const * s, char const * n) {
+    return seq_set_name_n(p, s, SEQ_TERMINATED, n);
+}
+
+/*Returns name of sequence at position pos, NULL with errno 0 if it has none.*/
+char const * pos_get_name(seq_t * p, seq_pos_t pos) {
+    char const * name = NULL;
+    int32_t member = node_class(seq_node(p, pos.node));
+    errno = 0;
+    if (member >= 0) name = class_text(p, member_class(p, member));
+    return name;
+}
+
+/*Returns name of sequence s of given length from storage p.*/
+char const * seq_get_name_n(seq_t * p, char const * s, size_t length) {
+    if (!p || !s) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (p->sharding) return shards_get_name(p, s, length);
+    if (p->frozen) return frozen_get_name(p, s, length);
+
+    if (p->concurrent) seq_read_begin();
+    seq_pos_t current_seq;
+    int found = seq_find(p, s, length, &current_seq);
+
+    char const * name = NULL;
+    if (found == 1) name = pos_get_name(p, current_seq);
+    else if (!found) errno = 0;
+    if (p->concurrent) seq_read_end();
+    return name;
+}
+
+/*Returns name of sequence s from storage p.*/
+char const * seq_get_name(seq_t * p, char const * s) {
+    return seq_get_name_n(p, s, SEQ_TERMINATED);
+}
+
+/*Finds names of n sequences from seqs, of lengths from lengths, in storage p.
+* When lengths is NULL all sequences end with '\0'. Name of sequence k,
+* NULL if it is not stored, is illegal or has no name, goes to names[k].
+*
+* Returns 0, or -1 and assigns EINVAL to errno if any sequence is illegal.
+* When a name could not be made for lack of memory returns -1 with ENOMEM.
+*/
+int seq_get_name_many(
+    seq_t * p, char const * const * seqs, size_t const * lengths,
+    size_t n, char const ** names
+    ) {
+    if (!p || (n > 0 && (!seqs || !names))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int answer = 0;
+    bool no_memory = false;
+    if (p->sharding || p->frozen) {
+        for (size_t k = 0; k < n; k++) {
+            names[k] = seq_get_name_n(p, seqs[k], lengths ? lengths[k] : SEQ_TERMINATED);
+            if (!names[k] && errno == EINVAL) answer = -1;
+            if (!names[k] && errno == ENOMEM) no_memory = true;
+        }
+        errno = no_memory ? ENOMEM : answer == -1 ? EINVAL : 0;
+        return no_memory ? -1 : answer;
+    }
+
+    if (p->concurrent) seq_read_begin();
+    for (size_t base = 0; base < n; base += SEQ_GROUP) {
+        size_t m = n - base < SEQ_GROUP ? n - base : SEQ_GROUP;
+        seq_pos_t pos[SEQ_GROUP];
+        int found[SEQ_GROUP];
+        int32_t abs_class[SEQ_GROUP];
+        find_group(p, seqs + base, lengths ? lengths + base : NULL, m,
+            found, pos);
+
+        for (size_t k = 0; k < m; k++) {
+            abs_class[k] = -1;
+            if (found[k] == -1) answer = -1;
+            if (found[k] != 1) continue;
+            int32_t member = node_class(seq_node(p, pos[k].node));
+            if (member >= 0) abs_class[k] = member_class(p, member);
+            if (abs_class[k] >= 0) class_prefetch(p, abs_class[k]);
+        }
+
+        for (size_t k = 0; k < m; k++) {
+            names[base + k] = NULL;
+            if (abs_class[k] < 0) continue;
+            errno = 0;
+            names[base + k] = class_text(p, abs_class[k]);
+            if (!names[base + k] && errno == ENOMEM) no_memory = true;
+        }
+    }
+    if (p->concurrent) seq_read_end();
+
+    errno = no_memory ? ENOMEM : answer == -1 ? EINVAL : 0;
+    return no_memory ? -1 : answer;
+}
+
+/*Merges abstraction classes of sequences at positions pos_1 in storage p_1
+* and pos_2 in storage p_2 (the same storage or two shards of one storage),
+* cutting runs they are inside. Both positions are kept right.
+* The sequences are s1 and s2 of given lengths, NULL if they are not known.
+* Returns the same as seq_equiv.
+*/
+int pos_equiv(
+    seq_t * p_1, seq_pos_t * pos_1, char const * s1, size_t length_1,
+    seq_t * p_2, seq_pos_t * pos_2, char const * s2, size_t length_2
+    ) {
+    if (storage_write(p_1) == -1 || storage_write(p_2) == -1) return -1;
+    if (p_1->concurrent) retired_collect(p_1);
+    seq_node_t * run = seq_node(p_1, pos_1->node);
+    if (node_is_run(run)) {
+        seq_pos_t old_pos_1 = *pos_1;
+        uint64_t values = run_values(run);
+        if (pos_split(p_1, pos_1) == -1) return -1;
+
+        /*Sequences after pos_1 in the same run are now in the run
+        * which is the son of pos_1.
+        */
+        if (p_1 == p_2 && pos_2->node == old_pos_1.node) {
+            if (pos_2->offset == old_pos_1.offset) {
+                *pos_2 = *pos_1;
+            }
+            else if (pos_2->offset > old_pos_1.offset) {
+                int val = (int) ((values >> (2 * old_pos_1.offset)) & 3);
+                pos_2->node = seq_node(p_1, pos_1->node)->next[val];
+                pos_2->offset -= old_pos_1.offset + 1;
+            }
+        }
+    }
+    if (pos_split(p_2, pos_2) == -1) return -1;
+
+    seq_node_t * current_seq_1 = seq_node(p_1, pos_1->node);
+    seq_node_t * current_seq_2 = seq_node(p_2, pos_2->node);
+    seq_classes_t * classes = p_1->classes;
+    int abs_class_1 = current_seq_1->abstract_class;
+    int abs_class_2 = current_seq_2->abstract_class;
+
+    if (abs_class_1 != -1) abs_class_1 = class_find(
+        classes, member_at(classes, (uint32_t) abs_class_1)->abs_class
+    );
+    if (abs_class_2 != -1) abs_class_2 = class_find(
+        classes, member_at(classes, (uint32_t) abs_class_2)->abs_class
+    );
+
+    if (abs_class_1 != -1 && abs_class_1 == abs_class_2) return 0;
+
+    if (abs_class_1 == -1 && abs_class_2 == -1) {
+        int abs_class_n = class_new(classes);
+        if (abs_class_n == -1) return -1;
+        uint32_t member_1 = member_new(classes, abs_class_n, s1, length_1);
+        if (member_1 == SEQ_NO_MEMBER) {
+            classes->amount--;
+            return -1;
+        }
+        uint32_t member_2 = member_1;
+        if (current_seq_1 != current_seq_2) {
+            member_2 = member_new(classes, abs_class_n, s2, length_2);
+            if (member_2 == SEQ_NO_MEMBER) {
+                member_free(classes, member_1);
+                classes->amount--;
+                return -1;
+            }
+        }
+        node_set_class(current_seq_1, (int32_t) member_1);
+        node_set_class(current_seq_2, (int32_t) member_2);
+        return 1;
+    }
+
+    if (abs_class_1 == -1) {
+        uint32_t member_1 = member_new(classes, abs_class_2, s1, length_1);
+        if (member_1 == SEQ_NO_MEMBER) return -1;
+        node_set_class(current_seq_1, (int32_t) member_1);
+        return 1;
+    }
+    if (abs_class_2 == -1) {
+        uint32_t member_2 = member_new(classes, abs_class_1, s2, length_2);
+        if (member_2 == SEQ_NO_MEMBER) return -1;
+        node_set_class(current_seq_2, (int32_t) member_2);
+        return 1;
+    }
+
+    if (class_own(classes, abs_class_1) == -1 || class_own(classes, abs_class_2) == -1)
+        return -1;
+
+    seq_names_t * names = &classes->names;
+    seq_name_t * name_1 = class_at(classes, abs_class_1)->name;
+    seq_name_t * name_2 = class_at(classes, abs_class_2)->name;
+    seq_name_t * name_n = NULL;
+
+    if (name_1 && (!name_2 || name_1 == name_2)) {
+        name_n = name_1;
+        name_n->references++;
+    }
+    else if (!name_1 && name_2) {
+        name_n = name_2;
+        name_n->references++;
+    }
+    else if (name_1 && name_2) {
+        name_n = name_join(names, name_1, name_2);
+        if (name_n == NULL) return -1;
+    }
+
+    /*Both classes get the merged name before they are joined, so that
+    * readers never see a class without it. Readers which come to the old
+    * representative after its name is cleared go on to the new one, see
+    * class_root_name.
+    */
+    class_set_name(classes, abs_class_1, name_n);
+    class_set_name(classes, abs_class_2, name_n);
+    int abs_class_n = class_union(classes, abs_class_1, abs_class_2);
+    int abs_class_old = abs_class_n == abs_class_1 ? abs_class_2 : abs_class_1;
+    class_set_name(classes, abs_class_old, NULL);
+    members_splice(classes, abs_class_n, abs_class_old);
+    if (name_1) name_release(names, name_1);
+    if (name_2) name_release(names, name_2);
+
+    return 1;
+}
+
+/*Changes abstraction class of two sequences of given lengths to same class
+* and merges name of their classes.
+*/
+int equiv_n(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+    ) {
+    if (!p || !s1 || !s2) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) return shards_equiv(p, s1, length_1, s2, length_2);
+    if (p->frozen || p->origin) {
+        errno = EPERM;
+        return -1;
+    }
+
+    seq_pos_t current_pos_1;
+    seq_pos_t current_pos_2;
+    int found_1 = seq_find(p, s1, length_1, &current_pos_1);
+    if (found_1 == -1) return -1;
+    int found_2 = seq_find(p, s2, length_2, &current_pos_2);
+    if (found_2 == -1) return -1;
+
+    if (s1 == s2 && length_1 == length_2) return 0;
+    if (!found_1 || !found_2) return 0;
+    if (p->snapshots && (seq_own(p, s1, length_1, &current_pos_1) == -1
+        || seq_own(p, s2, length_2, &current_pos_2) == -1)) return -1;
+
+    return pos_equiv(p, &current_pos_1, s1, length_1, p, &current_pos_2, s2, length_2);
+}
+
+/*Does equiv_n, counted as SEQ_OP_EQUIV.*/
+int seq_equiv_n(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+    ) {
+    SEQ_MEASURE(p, SEQ_OP_EQUIV, equiv_n(p, s1, length_1, s2, length_2));
+}
+
+/*Changes abstraction class of two sequences to same class
+* and merges name of their classes.
+*/
+int seq_equiv(seq_t * p, char const * s1, char const * s2) {
+    return seq_equiv_n(p, s1, SEQ_TERMINATED, s2, SEQ_TERMINATED);
+}
+
+/*Tells whether cursor c can be used: it was placed in a storage
+* and nothing moved stored sequences since then.
+*/
+static inline bool cursor_live(seq_cursor_t const * c) {
+    return c && c->storage && c->generation == c->storage->generation;
+}
+
+/*Moves cursor c along sequence s of given length. Cursor does not move
+* if s is not stored after it. In storage with snapshots the way it moves
+* is copied, so that changes through cursor need not copy anything.
+*/
+int seq_cursor_step_n(seq_cursor_t * c, char const * s, size_t length) {
+    if (!cursor_live(c) || !s) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    seq_pos_t pos = {c->node, c->offset};
+    int found = pos_find(c->storage, s, length, &pos);
+    if (found == 1 && c->storage->snapshots) {
+        pos.node = c->node;
+        pos.offset = c->offset;
+        if (pos_own(c->storage, s, length, &pos) == -1) return -1;
+    }
+    if (found == 1) {
+        c->node = pos.node;
+        c->offset = pos.offset;
+    }
+    return found;
+}
+
+/*Moves cursor c along sequence s.*/
+int seq_cursor_step(seq_cursor_t * c, char const * s) {
+    return seq_cursor_step_n(c, s, SEQ_TERMINATED);
+}
+
+/*Places cursor c on sequence s of given length from storage p.
+* If s is not stored, cursor is left on the empty sequence.
+*/
+int seq_cursor_seek_n(
+    seq_cursor_t * c, seq_t * p, char const * s, size_t length
+    ) {
+    if (!c || !p || p->sharding || p->frozen || p->origin) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->storage = p;
+    c->node = 0;
+    c->offset = 0;
+    c->generation = p->generation;
+    return seq_cursor_step_n(c, s, length);
+}
+
+/*Places cursor c on sequence s from storage p.*/
+int seq_cursor_seek(seq_cursor_t * c, seq_t * p, char const * s) {
+    return seq_cursor_seek_n(c, p, s, SEQ_TERMINATED);
+}
+
+/*Changes name of sequence shown by cursor c to n, the same as seq_set_name.
+* Cutting a run makes other cursors stale, c itself is kept right.
+*/
+int seq_cursor_set_name(seq_cursor_t * c, char const * n) {
+    if (!cursor_live(c) || !c->node || !n || !*n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    seq_pos_t pos = {c->node, c->offset};
+    int result = pos_set_name(c->storage, &pos, NULL, 0, n, strlen(n));
+    c->node = pos.node;
+    c->offset = pos.offset;
+    c->generation = c->storage->generation;
+    return result;
+}
+
+/*Returns name of sequence shown by cursor c, the same as seq_get_name.*/
+char const * seq_cursor_get_name(seq_cursor_t const * c) {
+    if (!cursor_live(c) || !c->node) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    seq_pos_t pos = {c->node, c->offset};
+    return pos_get_name(c->storage, pos);
+}
+
+/*Merges abstraction classes of sequences shown by cursors c1 and c2,
+* the same as seq_equiv. Both cursors are kept right.
+*/
+int seq_cursor_equiv(seq_cursor_t * c1, seq_cursor_t * c2) {
+    if (!cursor_live(c1) || !cursor_live(c2) || c1->storage != c2->storage
+        || !c1->node || !c2->node) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (c1 == c2) return 0;
+
+    seq_pos_t pos_1 = {c1->node, c1->offset};
+    seq_pos_t pos_2 = {c2->node, c2->offset};
+    int result = pos_equiv(c1->storage, &pos_1, NULL, 0, c2->storage, &pos_2, NULL, 0);
+    c1->node = pos_1.node;
+    c1->offset = pos_1.offset;
+    c1->generation = c1->storage->generation;
+    c2->node = pos_2.node;
+    c2->offset = pos_2.offset;
+    c2->generation = c2->storage->generation;
+    return result;
+}
+
+/*Sequence on the path of an iterator and the value of its son which
+* is visited next, SEQ_ALPHABET when all its sons are done.
+*/
+typedef struct seq_iter_frame {
+    seq_pos_t pos;
+    int val;
+} seq_iter_frame_t;
+
+/*Number of frames an iterator starts with.*/
+#define SEQ_ITER_FRAMES 16
+
+/*Makes room for twice as many frames of iterator it, together with
+* the text of longer sequences. Returns 0, or -1 with ENOMEM.
+*/
+static int iter_grow(seq_iter_t * it) {
+    size_t capacity = it->capacity ? 2 * it->capacity : SEQ_ITER_FRAMES;
+
+    char * text = (char *) realloc(it->text, it->prefix + capacity + 1);
+    if (!text) {
+        errno = ENOMEM;
+        return -1;
+    }
+    it->text = text;
+
+    seq_iter_frame_t * frames = (seq_iter_frame_t *) realloc(
+        it->frames, sizeof(seq_iter_frame_t) * capacity
+    );
+    if (!frames) {
+        errno = ENOMEM;
+        return -1;
+    }
+    it->frames = frames;
+    it->capacity = capacity;
+    return 0;
+}
+
+/*Describes sequence at position pos, which iterator it has just reached,
+* in entry. Returns 0, or -1 with ENOMEM when its name could not be made.
+*/
+static int iter_entry(seq_iter_t * it, seq_pos_t pos, seq_entry_t * entry) {
+    seq_t * p = it->storage;
+    size_t length = it->prefix + it->depth - 1;
+    int32_t member = node_class(seq_node(p, pos.node));
+
+    entry->abs_class = -1;
+    entry->name = NULL;
+    if (member >= 0) {
+        int abs_class = member_class(p, member);
+        errno = 0;
+        entry->name = class_text(p, abs_class);
+        if (!entry->name && errno == ENOMEM) return -1;
+
+        seq_mapping_t const * mapping = p->mapping;
+        if (mapping && mapping->classes)
+            entry->abs_class = (int) mapping->classes[abs_class].parent;
+        else entry->abs_class = class_lookup(p, abs_class);
+    }
+
+    it->text[length] = '\0';
+    entry->sequence = it->text;
+    entry->length = length;
+    return 0;
+}
+
+/*Walks iterator it to its next sequence, visiting sons of each sequence
+* by their values, so that every sequence comes before its extensions
+* and extensions come in lexicographic order. Returns the same
+* as seq_iter_next.
+*/
+static int iter_walk(seq_iter_t * it, seq_entry_t * entry) {
+    seq_t * p = it->storage;
+    if (__atomic_load_n(&p->generation, __ATOMIC_ACQUIRE) != it->generation) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (it->depth) {
+        seq_iter_frame_t * top = &it->frames[it->depth - 1];
+        if (it->pending) {
+            if (iter_entry(it, top->pos, entry) == -1) return -1;
+            it->pending = 0;
+            return 1;
+        }
+        if (top->val == SEQ_ALPHABET) {
+            it->depth--;
+            continue;
+        }
+
+        seq_pos_t son = top->pos;
+        if (!pos_next(p, &son, top->val)) {
+            top->val++;
+            continue;
+        }
+        if (it->depth == it->capacity && iter_grow(it) == -1) return -1;
+
+        top = &it->frames[it->depth - 1];
+        it->text[it->prefix + it->depth - 1] = seq_symbol(top->val++);
+        it->frames[it->depth].pos = son;
+        it->frames[it->depth].val = 0;
+        it->depth++;
+        it->pending = 1;
+    }
+    return 0;
+}
+
+/*Places iterator it before sequences of storage p beginning with prefix
+* of given length.
+*/
+int seq_iter_prefix_n(
+    seq_t * p, char const * prefix, size_t length, seq_iter_t * it
+    ) {
+    if (!p || !prefix || !it || p->sharding || p->frozen) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t prefix_length = seq_scan(prefix, length, 0);
+    if (prefix_length == SEQ_SCAN_WRONG) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    it->storage = p;
+    it->frames = NULL;
+    it->depth = 0;
+    it->capacity = 0;
+    it->text = NULL;
+    it->prefix = prefix_length;
+    it->pending = 0;
+    if (iter_grow(it) == -1) {
+        seq_iter_free(it);
+        return -1;
+    }
+    memcpy(it->text, prefix, prefix_length);
+
+    if (p->concurrent) seq_read_begin();
+    it->generation = __atomic_load_n(&p->generation, __ATOMIC_ACQUIRE);
+    seq_pos_t pos = {p->root, 0};
+    int found = prefix_length ? pos_find(p, prefix, prefix_length, &pos) : 1;
+    if (p->concurrent) seq_read_end();
+
+    if (found == 1) {
+        it->frames[0].pos = pos;
+        it->frames[0].val = 0;
+        it->depth = 1;
+        it->pending = prefix_length > 0;
+    }
+    return found;
+}
+
+/*Places iterator it before sequences of storage p beginning with prefix.*/
+int seq_iter_prefix(seq_t * p, char const * prefix, seq_iter_t * it) {
+    return seq_iter_prefix_n(p, prefix, SEQ_TERMINATED, it);
+}
+
+/*Moves iterator it to its next sequence and describes it in entry.*/
+int seq_iter_next(seq_iter_t * it, seq_entry_t * entry) {
+    if (!it || !it->storage || !entry) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    seq_t * p = it->storage;
+    if (p->concurrent) seq_read_begin();
+    int result = iter_walk(it, entry);
+    if (p->concurrent) seq_read_end();
+    return result;
+}
+
+/*Frees buffers of iterator it.*/
+void seq_iter_free(seq_iter_t * it) {
+    if (!it) return;
+    free(it->frames);
+    free(it->text);
+    it->storage = NULL;
+    it->frames = NULL;
+    it->text = NULL;
+    it->depth = 0;
+    it->capacity = 0;
+}
+
+/*Largest number of leading values by which sequences are sharded.*/
+#define SEQ_SHARD_LEVELS 5
+/*Largest number of threads working on shards together.*/
+#define SEQ_SHARD_THREADS 16
+/*Batches with fewer sequences are added to their shards by one thread.*/
+#define SEQ_SHARD_SERIAL 4096
+/*Sharded storages with fewer nodes are deleted by one thread.*/
+#define SEQ_SHARD_SERIAL_NODES 65536
+
+/*Shard of a sharded storage, storage is changed only under lock.*/
+typedef struct seq_shard {
+    seq_t * storage;
+    pthread_mutex_t lock;
+} seq_shard_t;
+
+/*Work shared by threads of shards_run, next is the next unit to be taken.*/
+typedef struct seq_shard_job {
+    void (*work)(void *, int);
+    void * arg;
+    int amount;
+    int next;
+} seq_shard_job_t;
+
+/*Threads of a sharded storage which help with its jobs, threads of them,
+* started with the storage and joined when it is deleted.
+*
+* shards_run holding run puts its job in job and bumps round, which wakes
+* the threads; each takes part in every round once and the last one to be
+* done with it (busy drops to zero) signals done. Under lock, until stop
+* tells threads to end.
+*/
+typedef struct seq_shard_pool {
+    pthread_t helpers[SEQ_SHARD_THREADS - 1];
+    int threads;
+    pthread_mutex_t run;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    seq_shard_job_t * job;
+    uint64_t round;
+    int busy;
+    bool stop;
+} seq_shard_pool_t;
+
+/*Sequences of a sharded storage starting with the same levels values are
+* kept in the same of amount (SEQ_ALPHABET to the power of levels) shards,
+* numbered by those values read as a number in base SEQ_ALPHABET. Shorter
+* sequences are kept in shards[amount], the top shard, which also has the
+* prefix of length levels - 1 of every longer sequence, so it knows all
+* sequences which are too short to have a shard.
+*
+* All shards use the abstraction classes of the sharded storage, which are
+* changed only under classes_lock. Names dropped there are retired as in
+* concurrent storages, since returned names are read after it is let go.
+* Locks are always taken in increasing order of shards, the top one last,
+* and classes_lock after all of them.
+*/
+typedef struct seq_sharding {
+    unsigned levels;
+    int amount;
+    pthread_mutex_t classes_lock;
+    seq_shard_pool_t pool;
+    seq_shard_t shards[];
+} seq_sharding_t;
+
+/*Lets other threads change classes of sharded storage p, freeing first
+* the names dropped meanwhile which no reader can see any more.
+*/
+static inline void classes_unlock(seq_t * p) {
+    if (p->classes->names.retired) names_reclaim(&p->classes->names);
+    pthread_mutex_unlock(&p->sharding->classes_lock);
+}
+
+/*Returns number of the shard keeping sequence s of given length.
+* For empty sequence or illegal value among the first levels ones
+* returns -1 and assigns EINVAL to errno.
+*/
+int shard_index(seq_sharding_t const * sharding, char const * s, size_t length) {
+    int index = 0;
+    for (unsigned i = 0; i < sharding->levels; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END && i > 0) return sharding->amount;
+        if (val == SEQ_END || val == SEQ_WRONG) {
+            errno = EINVAL;
+            return -1;
+        }
+        index = SEQ_ALPHABET * index + val;
+    }
+    return index;
+}
+
+/*Does units of job until none is left.*/
+void shard_work(seq_shard_job_t * job) {
+    for (;;) {
+        int unit = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (unit >= job->amount) return;
+        job->work(job->arg, unit);
+    }
+}
+
+/*Thread of pool arg, taking part in every round until it is stopped.*/
+void * shard_helper(void * arg) {
+    seq_shard_pool_t * pool = (seq_shard_pool_t *) arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->round == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop) break;
+
+        seen = pool->round;
+        seq_shard_job_t * job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+        shard_work(job);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*Prepares pool of a new sharded storage, with no threads yet.*/
+void shard_pool_init(seq_shard_pool_t * pool) {
+    pool->threads = 0;
+    pthread_mutex_init(&pool->run, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->job = NULL;
+    pool->round = 0;
+    pool->busy = 0;
+    pool->stop = false;
+}
+
+/*Starts threads of pool, one fewer than processors, at most one fewer
+* than units, so that together with the calling thread each unit can have
+* a thread. Fewer are kept if no more can be started.
+*/
+void shard_pool_start(seq_shard_pool_t * pool, int units) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = online > 0 && online < SEQ_SHARD_THREADS
+        ? (int) online : SEQ_SHARD_THREADS;
+    if (threads > units) threads = units;
+    while (pool->threads < threads - 1
+        && !pthread_create(&pool->helpers[pool->threads], NULL, shard_helper, pool))
+        pool->threads++;
+}
+
+/*Stops and joins threads of pool and frees what it holds.*/
+void shard_pool_stop(seq_shard_pool_t * pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads; i++) pthread_join(pool->helpers[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run);
+}
+
+/*Calls work(arg, unit) for every unit from 0 to amount - 1, with threads
+* of the pool of sharding if parallel is set. Calling thread takes part,
+* so all units are done alone when the pool has no threads or is busy
+* with a job of another thread.
+*/
+void shards_run(
+    seq_sharding_t * sharding, int amount, bool parallel,
+    void (*work)(void *, int), void * arg
+    ) {
+    seq_shard_pool_t * pool = &sharding->pool;
+    seq_shard_job_t job = {work, arg, amount, 0};
+
+    if (!parallel || amount < 2 || pool->threads == 0
+        || pthread_mutex_trylock(&pool->run)) {
+        shard_work(&job);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = &job;
+    pool->busy = pool->threads;
+    pool->round++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    shard_work(&job);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pool->job = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run);
+}
+
+/*Same as seq_add_n for sharded storage p.*/
+int shards_add(seq_t * p, char const * s, size_t length) {
+    seq_sharding_t * sharding = p->sharding;
+    int index = shard_index(sharding, s, length);
+    if (index == -1) return -1;
+
+    seq_shard_t * shard = &sharding->shards[index];
+    seq_shard_t * top = &sharding->shards[sharding->amount];
+    seq_batch_link_t link;
+
+    pthread_mutex_lock(&shard->lock);
+    int result = add_link(shard->storage, s, length, &link);
+    if (result == 1 && shard != top && sharding->levels > 1) {
+        pthread_mutex_lock(&top->lock);
+        int prefix = seq_add_n(top->storage, s, sharding->levels - 1);
+        pthread_mutex_unlock(&top->lock);
+
+        if (prefix == -1) {
+            link_cut(shard->storage, link);
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/*Sequences of a batch split among shards of sharded storage. Sequences
+* for shard i are items from start[i] to start[i + 1] - 1, chains attached
+* for them go to links from start[i].
+*/
+typedef struct seq_shard_batch {
+    seq_sharding_t * sharding;
+    seq_batch_item_t * items;
+    seq_batch_link_t * links;
+    size_t * start;
+    int * used;
+    int * results;
+    size_t * linked;
+    size_t longest;
+} seq_shard_batch_t;
+
+/*Adds sequences of a batch to shard number used[unit].*/
+void shard_batch_work(void * arg, int unit) {
+    seq_shard_batch_t * batch = (seq_shard_batch_t *) arg;
+    int index = batch->used[unit];
+    seq_batch_item_t * items = batch->items + batch->start[index];
+    size_t n = batch->start[index + 1] - batch->start[index];
+
+    bool sorted = true;
+    for (size_t k = 1; k < n && sorted; k++)
+        if (batch_compare(&items[k - 1], &items[k]) > 0) sorted = false;
+    if (!sorted) qsort(items, n, sizeof(seq_batch_item_t), batch_compare);
+
+    seq_pos_t * path =
+        (seq_pos_t *) malloc(sizeof(seq_pos_t) * (batch->longest + 1));
+    batch->linked[unit] = 0;
+    if (!path) {
+        batch->results[unit] = -1;
+        return;
+    }
+
+    batch->results[unit] = batch_insert(
+        batch->sharding->shards[index].storage, items, n, path,
+        batch->links + batch->start[index], &batch->linked[unit]
+    );
+    free(path);
+}
+
+/*Same as seq_add_batch for sharded storage p and n correct sequences
+* from scanned, with their lengths, of which the longest has given length.
+* Each shard gets its sequences added by one of parallel threads.
+*/
+int shards_add_batch(
+    seq_t * p, seq_batch_item_t const * scanned, size_t n, size_t longest
+    ) {
+    seq_sharding_t * sharding = p->sharding;
+    int groups = sharding->amount + 1;
+    size_t total = 0;
+    int used_amount = 0;
+
+    size_t * start = (size_t *) calloc(groups + 1, sizeof(size_t));
+    int * used = (int *) malloc(sizeof(int) * groups);
+    int * results = (int *) malloc(sizeof(int) * groups);
+    size_t * linked = (size_t *) malloc(sizeof(size_t) * groups);
+    seq_batch_item_t * items = NULL;
+    seq_batch_link_t * links = NULL;
+
+    if (start && used && results && linked) {
+        for (size_t k = 0; k < n; k++) {
+            int index = shard_index(sharding, scanned[k].s, scanned[k].length);
+            start[index + 1]++;
+            if (index < sharding->amount && sharding->levels > 1)
+                start[groups]++;
+        }
+        for (int i = 0; i < groups; i++) {
+            if (start[i + 1] > 0) used[used_amount++] = i;
+            start[i + 1] += start[i];
+        }
+        total = start[groups];
+        items = (seq_batch_item_t *) malloc(sizeof(seq_batch_item_t) * total);
+        links = (seq_batch_link_t *) malloc(sizeof(seq_batch_link_t) * total);
+    }
+
+    int result = -1;
+    if (!items || !links) {
+        errno = ENOMEM;
+    }
+    else {
+        /*start[i] moves along group i while it is filled, then back.*/
+        for (size_t k = 0; k < n; k++) {
+            int index = shard_index(sharding, scanned[k].s, scanned[k].length);
+            seq_batch_item_t item = scanned[k];
+            items[start[index]++] = item;
+            if (index < sharding->amount && sharding->levels > 1) {
+                item.length = sharding->levels - 1;
+                items[start[groups - 1]++] = item;
+            }
+        }
+        for (int i = groups; i > 0; i--) start[i] = start[i - 1];
+        start[0] = 0;
+
+        seq_shard_batch_t batch = {
+            sharding, items, links, start, used, results, linked, longest
+        };
+        for (int u = 0; u < used_amount; u++)
+            pthread_mutex_lock(&sharding->shards[used[u]].lock);
+        shards_run(sharding, used_amount, total >= SEQ_SHARD_SERIAL,
+            shard_batch_work, &batch);
+
+        result = 0;
+        for (int u = 0; u < used_amount; u++) {
+            if (results[u] == -1) result = -1;
+            else if (results[u] == 1 && result == 0) result = 1;
+        }
+        if (result == -1) {
+            for (int u = 0; u < used_amount; u++) {
+                if (results[u] == -1) continue;
+                batch_rollback(sharding->shards[used[u]].storage,
+                    links + start[used[u]], linked[u]);
+            }
+            errno = ENOMEM;
+        }
+
+        for (int u = used_amount; u > 0; u--)
+            pthread_mutex_unlock(&sharding->shards[used[u - 1]].lock);
+    }
+
+    free(start);
+    free(used);
+    free(results);
+    free(linked);
+    free(items);
+    free(links);
+    return result;
+}
+
+/*Same as seq_remove_n for sharded storage p. Sequence too short to have
+* a shard is removed from the top shard and from every shard whose
+* sequences start with it.
+*/
+int shards_remove(seq_t * p, char const * s, size_t length) {
+    seq_sharding_t * sharding = p->sharding;
+    int index = shard_index(sharding, s, length);
+    if (index == -1) return -1;
+
+    if (index < sharding->amount) {
+        seq_shard_t * shard = &sharding->shards[index];
+        pthread_mutex_lock(&shard->lock);
+        pthread_mutex_lock(&sharding->classes_lock);
+        int result = seq_remove_n(shard->storage, s, length);
+        classes_unlock(p);
+        pthread_mutex_unlock(&shard->lock);
+        return result;
+    }
+
+    int first = 0;
+    int width = sharding->amount;
+    for (size_t i = 0; seq_at(s, length, i) != SEQ_END; i++) {
+        first = SEQ_ALPHABET * first + seq_at(s, length, i);
+        width /= SEQ_ALPHABET;
+    }
+    first *= width;
+
+    seq_shard_t * top = &sharding->shards[sharding->amount];
+    for (int i = first; i < first + width; i++)
+        pthread_mutex_lock(&sharding->shards[i].lock);
+    pthread_mutex_lock(&top->lock);
+    pthread_mutex_lock(&sharding->classes_lock);
+
+    int result = seq_remove_n(top->storage, s, length);
+    if (result == 1) {
+        for (int i = first; i < first + width; i++)
+            seq_remove_n(sharding->shards[i].storage, s, length);
+    }
+
+    classes_unlock(p);
+    pthread_mutex_unlock(&top->lock);
+    for (int i = first + width; i > first; i--)
+        pthread_mutex_unlock(&sharding->shards[i - 1].lock);
+    return result;
+}
+
+/*Same as seq_valid_n for sharded storage p.*/
+int shards_valid(seq_t * p, char const * s, size_t length) {
+    int index = shard_index(p->sharding, s, length);
+    if (index == -1) return -1;
+
+    seq_shard_t * shard = &p->sharding->shards[index];
+    pthread_mutex_lock(&shard->lock);
+    int result = seq_valid_n(shard->storage, s, length);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/*Same as seq_set_name_n for sharded storage p.*/
+int shards_set_name(seq_t * p, char const * s, size_t length, char const * n) {
+    int index = shard_index(p->sharding, s, length);
+    if (index == -1) return -1;
+
+    seq_shard_t * shard = &p->sharding->shards[index];
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&p->sharding->classes_lock);
+    int result = seq_set_name_n(shard->storage, s, length, n);
+    classes_unlock(p);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/*Same as seq_get_name_n for sharded storage p. Names are retired like
+* in concurrent storages, so the name stays valid after the locks are let
+* go while the caller keeps reading.
+*/
+char const * shards_get_name(seq_t * p, char const * s, size_t length) {
+    int index = shard_index(p->sharding, s, length);
+    if (index == -1) return NULL;
+
+    seq_shard_t * shard = &p->sharding->shards[index];
+    seq_read_begin();
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&p->sharding->classes_lock);
+    char const * name = seq_get_name_n(shard->storage, s, length);
+    int error = errno;
+    classes_unlock(p);
+    pthread_mutex_unlock(&shard->lock);
+    seq_read_end();
+    errno = error;
+    return name;
+}
+
+/*Same as seq_equiv_n for sharded storage p. Sequences may be kept
+* in different shards, their classes are merged all the same.
+*/
+int shards_equiv(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+    ) {
+    seq_sharding_t * sharding = p->sharding;
+    int index_1 = shard_index(sharding, s1, length_1);
+    if (index_1 == -1) return -1;
+    int index_2 = shard_index(sharding, s2, length_2);
+    if (index_2 == -1) return -1;
+
+    seq_shard_t * shard_1 = &sharding->shards[index_1];
+    seq_shard_t * shard_2 = &sharding->shards[index_2];
+    pthread_mutex_lock(&sharding->shards[index_1 < index_2 ? index_1 : index_2].lock);
+    if (index_1 != index_2)
+        pthread_mutex_lock(&sharding->shards[index_1 < index_2 ? index_2 : index_1].lock);
+    pthread_mutex_lock(&sharding->classes_lock);
+
+    seq_pos_t current_pos_1;
+    seq_pos_t current_pos_2;
+    int result = 0;
+    int found_1 = seq_find(shard_1->storage, s1, length_1, &current_pos_1);
+    int found_2 = found_1 == -1
+        ? -1 : seq_find(shard_2->storage, s2, length_2, &current_pos_2);
+
+    if (found_1 == -1 || found_2 == -1) result = -1;
+    else if ((s1 != s2 || length_1 != length_2) && found_1 && found_2)
+        result = pos_equiv(shard_1->storage, &current_pos_1, s1, length_1,
+            shard_2->storage, &current_pos_2, s2, length_2);
+    int error = errno;
+
+    classes_unlock(p);
+    if (index_1 != index_2) pthread_mutex_unlock(&shard_2->lock);
+    pthread_mutex_unlock(&shard_1->lock);
+    errno = error;
+    return result;
+}
+
+/*Deletes storage of shard number unit of sharding arg.*/
+void shard_delete_work(void * arg, int unit) {
+    seq_sharding_t * sharding = (seq_sharding_t *) arg;
+    seq_delete(sharding->shards[unit].storage);
+}
+
+/*Deletes all shards of sharded storage p, with threads of its pool
+* unless the shards are small, then stops the pool.
+*/
+void shards_delete(seq_t * p) {
+    seq_sharding_t * sharding = p->sharding;
+    uint64_t nodes = 0;
+    for (int i = 0; i <= sharding->amount; i++)
+        if (sharding->shards[i].storage) nodes += sharding->shards[i].storage->used;
+
+    shards_run(sharding, sharding->amount + 1, nodes >= SEQ_SHARD_SERIAL_NODES,
+        shard_delete_work, sharding);
+    shard_pool_stop(&sharding->pool);
+    for (int i = 0; i <= sharding->amount; i++)
+        pthread_mutex_destroy(&sharding->shards[i].lock);
+    pthread_mutex_destroy(&sharding->classes_lock);
+    free(sharding);
+    p->sharding = NULL;
+}
+
+/*Initialize new structure for storing sequences, which keeps sequences
+* in shards by their first levels values (from 1 to SEQ_SHARD_LEVELS),
+* so that threads working on different shards do not wait for each other.
+*/
+seq_t * seq_new_sharded(unsigned levels) {
+    if (levels < 1 || levels > SEQ_SHARD_LEVELS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    seq_t * return_seq = seq_create(false);
+    if (!return_seq) return NULL;
+
+    int amount = 1;
+    for (unsigned i = 0; i < levels; i++) amount *= SEQ_ALPHABET;
+    seq_sharding_t * sharding = (seq_sharding_t *) calloc(
+        1, sizeof(seq_sharding_t) + sizeof(seq_shard_t) * (amount + 1)
+    );
+    if (!sharding) {
+        seq_delete(return_seq);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    sharding->levels = levels;
+    sharding->amount = amount;
+    pthread_mutex_init(&sharding->classes_lock, NULL);
+    return_seq->classes->names.deferred = true;
+    shard_pool_init(&sharding->pool);
+    for (int i = 0; i <= amount; i++)
+        pthread_mutex_init(&sharding->shards[i].lock, NULL);
+    return_seq->sharding = sharding;
+
+    for (int i = 0; i <= amount; i++) {
+        seq_t * storage = seq_create(false);
+        if (!storage) {
+            seq_delete(return_seq);
+            errno = ENOMEM;
+            return NULL;
+        }
+        storage->classes = return_seq->classes;
+        sharding->shards[i].storage = storage;
+    }
+    shard_pool_start(&sharding->pool, amount + 1);
+    return return_seq;
+}
+
+/*Snapshot file holds nodes 0 to used - 1 of the storage one after another,
+* then amount records of classes, members records of members, names_size
+* bytes of names ending with '\0' each, texts_size bytes of packed sequences
+* of members, then this trailer. Numbers are written as in memory, so files
+* are read on machines of the same byte order.
+*
+* Nodes are at the very beginning of the file, so its first slabs can be
+* mapped in place: nodes refer to each other only by their numbers.
+* They are followed by zero bytes up to a multiple of the alignment
+* of class records (see snap_padding), so that records are read in place.
+* As nodes and values depend on SEQ_ALPHABET, files are read only by builds
+* with the same alphabet.
+*/
+typedef struct seq_snap_trailer {
+    char magic[8];
+    uint32_t version;
+    uint32_t compressed;
+    uint32_t used;
+    uint32_t free_nodes;
+    uint32_t amount;
+    uint32_t members;
+    uint32_t free_members;
+    uint32_t alphabet;
+    uint64_t names_size;
+    uint64_t texts_size;
+} seq_snap_trailer_t;
+
+#define SEQ_SNAP_MAGIC "SEQSNAP"
+#define SEQ_SNAP_VERSION 4
+_Static_assert(
+    _Alignof(seq_snap_member_t) <= _Alignof(seq_snap_class_t)
+        && sizeof(seq_snap_class_t) % _Alignof(seq_snap_member_t) == 0,
+    "member records must be aligned after class records"
+);
+
+/*Returns how many zero bytes follow used nodes in a snapshot file.*/
+static inline size_t snap_padding(uint64_t used) {
+    size_t bytes = (size_t) (used * sizeof(seq_node_t) % _Alignof(seq_snap_class_t));
+    return bytes ? _Alignof(seq_snap_class_t) - bytes : 0;
+}
+
+/*Size of the buffer in which seq_save collects what it writes.*/
+#define SEQ_SNAP_BUFFER 65536
+
+/*Buffer of bytes waiting to be written to file descriptor fd.*/
+typedef struct seq_snap_writer {
+    int fd;
+    size_t used;
+    char data[SEQ_SNAP_BUFFER];
+} seq_snap_writer_t;
+
+/*Writes out the buffer of writer w. In case of error returns -1,
+* errno is left as write set it.
+*/
+int snap_flush(seq_snap_writer_t * w) {
+    size_t done = 0;
+    while (done < w->used) {
+        ssize_t written = write(w->fd, w->data + done, w->used - done);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t) written;
+    }
+    w->used = 0;
+    return 0;
+}
+
+/*Adds size bytes from data to what writer w writes.*/
+int snap_write(seq_snap_writer_t * w, void const * data, size_t size) {
+    char const * bytes = (char const *) data;
+    while (size > 0) {
+        if (w->used == SEQ_SNAP_BUFFER && snap_flush(w) == -1) return -1;
+
+        size_t part = SEQ_SNAP_BUFFER - w->used;
+        if (part > size) part = size;
+        memcpy(w->data + w->used, bytes, part);
+        w->used += part;
+        bytes += part;
+        size -= part;
+    }
+    return 0;
+}
+
+/*Fills record with representative, rank and first member of class
+* number i of storage p. Returns its name if it is a representative
+* with a name, NULL otherwise.
+*/
+char const * snap_class(seq_t * p, int i, seq_snap_class_t * record) {
+    seq_mapping_t const * mapping = p->mapping;
+    if (mapping && mapping->classes) {
+        record->parent = mapping->classes[i].parent;
+        record->rank = mapping->classes[i].rank;
+        record->members = mapping->classes[i].members;
+    }
+    else {
+        record->parent = class_root(p->classes, i);
+        record->rank = class_at(p->classes, i)->rank;
+        record->members = class_at(p->classes, i)->members;
+    }
+    record->reserved = 0;
+    return record->parent == i ? class_text(p, i) : NULL;
+}
+
+/*Fills record with member number m of storage p. Returns its packed
+* sequence, NULL if it is not known or m is free.
+*/
+uint8_t const * snap_member(seq_t * p, uint32_t m, seq_snap_member_t * record) {
+    seq_mapping_t const * mapping = p->mapping;
+    uint8_t const * text = NULL;
+    if (mapping && mapping->classes) {
+        *record = mapping->members[m];
+        if (record->text != SEQ_SNAP_NO_NAME) text = mapping->texts + record->text;
+    }
+    else {
+        seq_member_t const * member = member_at(p->classes, m);
+        record->abs_class = member->abs_class;
+        record->next = member->next;
+        record->prev = member->prev;
+        record->reserved = 0;
+        record->length = member->length;
+        text = member->text;
+    }
+    return text;
+}
+
+/*Node number node written to a snapshot file as record instead of
+* the node in memory.
+*/
+typedef struct seq_snap_patch {
+    uint32_t node;
+    seq_node_t record;
+} seq_snap_patch_t;
+
+static int snap_patch_compare(void const * a, void const * b) {
+    uint32_t x = ((seq_snap_patch_t const *) a)->node;
+    uint32_t y = ((seq_snap_patch_t const *) b)->node;
+    return (x > y) - (x < y);
+}
+
+/*Makes patches for nodes of concurrent storage p below used which are free
+* in pools, amount of them in order of nodes, and assigns the first node
+* of the free list of the file to free_nodes. Free lists of all pools are
+* joined into one and nodes which pools took from slabs but did not give
+* out yet, never written in memory, are written cleared and added to it.
+*
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int snap_patches(
+    seq_t * p, uint32_t used, seq_snap_patch_t ** patches,
+    size_t * amount, uint32_t * free_nodes
+    ) {
+    size_t capacity = 0;
+    *patches = NULL;
+    *amount = 0;
+    *free_nodes = 0;
+
+    for (int i = 0; i < SEQ_READERS; i++) {
+        seq_pool_t const * pool = &p->pools[i];
+        uint32_t tail_end = pool->end < used ? pool->end : used;
+        size_t needed = (pool->free_nodes ? 1 : 0)
+            + (pool->next < tail_end ? tail_end - pool->next : 0);
+        if (*amount + needed > capacity) {
+            while (*amount + needed > capacity) capacity = capacity ? 2 * capacity : 64;
+            seq_snap_patch_t * grown = (seq_snap_patch_t *) realloc(
+                *patches, sizeof(seq_snap_patch_t) * capacity
+            );
+            if (!grown) {
+                free(*patches);
+                *patches = NULL;
+                errno = ENOMEM;
+                return -1;
+            }
+            *patches = grown;
+        }
+
+        /*Each piece is linked from the end of the one before: patch
+        * amount - 1, or free_nodes for the first piece.
+        */
+        for (uint32_t node = pool->next; node < tail_end; node++) {
+            seq_snap_patch_t * patch = &(*patches)[*amount];
+            patch->node = node;
+            node_clear(&patch->record);
+            if (*amount == 0) *free_nodes = node;
+            else (*patches)[*amount - 1].record.next[0] = node;
+            (*amount)++;
+        }
+
+        uint32_t node = pool->free_nodes;
+        if (!node) continue;
+        if (*amount == 0) *free_nodes = node;
+        else (*patches)[*amount - 1].record.next[0] = node;
+        while (seq_node(p, node)->next[0]) node = seq_node(p, node)->next[0];
+        seq_snap_patch_t * patch = &(*patches)[*amount];
+        patch->node = node;
+        patch->record = *seq_node(p, node);
+        patch->record.next[0] = 0;
+        (*amount)++;
+    }
+
+    qsort(*patches, *amount, sizeof(seq_snap_patch_t), snap_patch_compare);
+    return 0;
+}
+
+/*Writes storage p to file descriptor fd as a snapshot, which
+* seq_open_mapped can open. Returns 0, in case of error -1.
+*/
+int seq_save(seq_t * p, int fd) {
+    if (!p || fd < 0 || p->sharding || p->frozen || p->origin) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    seq_snap_writer_t * w = (seq_snap_writer_t *) malloc(sizeof(seq_snap_writer_t));
+    if (!w) {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->fd = fd;
+    w->used = 0;
+
+    int result = 0;
+    uint32_t used = __atomic_load_n(&p->used, __ATOMIC_ACQUIRE);
+    for (uint32_t slab = 0; slab < SEQ_SLABS; slab++) {
+        uint32_t start = SEQ_SLAB_MIN_NODES * ((1U << slab) - 1);
+        if (start >= used) break;
+        if (!p->slabs[slab]) {
+            used = start;
+            break;
+        }
+    }
+
+    seq_snap_patch_t * patches = NULL;
+    size_t patch_amount = 0;
+    uint32_t free_nodes = p->free_nodes;
+    if (p->concurrent) result = snap_patches(p, used, &patches, &patch_amount, &free_nodes);
+
+    /*Nodes are written a slab at a time, patched ones in between.*/
+    size_t k = 0;
+    for (uint32_t slab = 0; result == 0 && slab < SEQ_SLABS; slab++) {
+        uint32_t start = SEQ_SLAB_MIN_NODES * ((1U << slab) - 1);
+        if (start >= used) break;
+
+        uint32_t end = start + (SEQ_SLAB_MIN_NODES << slab);
+        if (end > used) end = used;
+        for (uint32_t node = start; result == 0 && node < end;) {
+            uint32_t stop = k < patch_amount && patches[k].node < end ? patches[k].node : end;
+            result = snap_write(w, seq_node(p, node), sizeof(seq_node_t) * (stop - node));
+            node = stop;
+            if (result == 0 && node < end) {
+                result = snap_write(w, &patches[k++].record, sizeof(seq_node_t));
+                node++;
+            }
+        }
+    }
+    free(patches);
+    static char const zeros[_Alignof(seq_snap_class_t)];
+    if (result == 0) result = snap_write(w, zeros, snap_padding(used));
+
+    bool mapped = p->mapping && p->mapping->classes;
+    int amount = mapped ? p->mapping->amount : p->classes->amount;
+    uint32_t members = mapped ? p->mapping->member_amount : p->classes->member_amount;
+    uint32_t free_members =
+        mapped ? p->mapping->free_members : p->classes->free_members;
+    uint64_t names_size = 0;
+    for (int i = 0; result == 0 && i < amount; i++) {
+        seq_snap_class_t record;
+        errno = 0;
+        char const * text = snap_class(p, i, &record);
+        if (!text && errno == ENOMEM) result = -1;
+        record.name = text ? names_size : SEQ_SNAP_NO_NAME;
+        if (text) names_size += strlen(text) + 1;
+        if (result == 0) result = snap_write(w, &record, sizeof(seq_snap_class_t));
+    }
+    uint64_t texts_size = 0;
+    for (uint32_t m = 0; result == 0 && m < members; m++) {
+        seq_snap_member_t record;
+        uint8_t const * text = snap_member(p, m, &record);
+        record.text = text ? texts_size : SEQ_SNAP_NO_NAME;
+        if (text) texts_size += record.length / 4 + 1;
+        result = snap_write(w, &record, sizeof(seq_snap_member_t));
+    }
+    for (int i = 0; result == 0 && i < amount; i++) {
+        seq_snap_class_t record;
+        char const * text = snap_class(p, i, &record);
+        if (text) result = snap_write(w, text, strlen(text) + 1);
+    }
+    for (uint32_t m = 0; result == 0 && m < members; m++) {
+        seq_snap_member_t record;
+        uint8_t const * text = snap_member(p, m, &record);
+        if (text) result = snap_write(w, text, record.length / 4 + 1);
+    }
+
+    seq_snap_trailer_t trailer = {
+        SEQ_SNAP_MAGIC, SEQ_SNAP_VERSION, p->compressed, used,
+        free_nodes, (uint32_t) amount,
+        members, free_members, SEQ_ALPHABET, names_size, texts_size
+    };
+    if (result == 0) result = snap_write(w, &trailer, sizeof(seq_snap_trailer_t));
+    if (result == 0) result = snap_flush(w);
+
+    free(w);
+    return result;
+}
+
+/*Opens snapshot from file descriptor fd, see seq_open_mapped.*/
+seq_t * snap_open(int fd) {
+    struct stat info;
+    seq_snap_trailer_t trailer;
+    if (fstat(fd, &info) == -1) return NULL;
+
+    uint64_t file_size = (uint64_t) info.st_size;
+    if (file_size < sizeof(seq_snap_trailer_t)
+        || pread(fd, &trailer, sizeof(seq_snap_trailer_t),
+            (off_t) (file_size - sizeof(seq_snap_trailer_t)))
+            != (ssize_t) sizeof(seq_snap_trailer_t)
+        || memcmp(trailer.magic, SEQ_SNAP_MAGIC, sizeof(trailer.magic))
+        || trailer.version != SEQ_SNAP_VERSION
+        || trailer.alphabet != SEQ_ALPHABET
+        || trailer.used == 0 || seq_slab(trailer.used - 1) >= SEQ_SLABS
+        || trailer.free_nodes >= trailer.used
+        || trailer.amount > INT32_MAX
+        || (trailer.free_members != SEQ_NO_MEMBER
+            && trailer.free_members >= trailer.members)
+        || trailer.names_size > file_size || trailer.texts_size > file_size
+        || (uint64_t) trailer.used * sizeof(seq_node_t) + snap_padding(trailer.used)
+            + (uint64_t) trailer.amount * sizeof(seq_snap_class_t)
+            + (uint64_t) trailer.members * sizeof(seq_snap_member_t)
+            + trailer.names_size + trailer.texts_size
+            + sizeof(seq_snap_trailer_t) != file_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /*The last slab is mapped whole, its part past the file is memory
+    * of its own, so that nodes can be added there later.
+    */
+    uint32_t slabs = seq_slab(trailer.used - 1) + 1;
+    uint64_t size = (uint64_t) SEQ_SLAB_MIN_NODES * ((1ULL << slabs) - 1)
+        * sizeof(seq_node_t);
+    if (size < file_size) size = file_size;
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    void * base = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    if (mmap(base, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)
+        == MAP_FAILED) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    seq_node_t * nodes = (seq_node_t *) base;
+    seq_snap_class_t const * classes = (seq_snap_class_t const *)
+        ((char const *) (nodes + trailer.used) + snap_padding(trailer.used));
+    seq_snap_member_t const * members =
+        (seq_snap_member_t const *) (classes + trailer.amount);
+    char const * names = (char const *) (members + trailer.members);
+    if (trailer.names_size > 0 && names[trailer.names_size - 1]) {
+        munmap(base, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    seq_t * return_seq = seq_create(trailer.compressed != 0);
+    seq_mapping_t * mapping = (seq_mapping_t *) malloc(sizeof(seq_mapping_t));
+    if (!return_seq || !mapping) {
+        munmap(base, size);
+        seq_delete(return_seq);
+        free(mapping);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mapping->base = base;
+    mapping->size = size;
+    mapping->slabs = slabs;
+    mapping->amount = (int) trailer.amount;
+    mapping->member_amount = trailer.members;
+    mapping->free_members = trailer.free_members;
+    mapping->classes = classes;
+    mapping->members = members;
+    mapping->names = names;
+    mapping->names_size = trailer.names_size;
+    mapping->texts = (uint8_t const *) names + trailer.names_size;
+    mapping->texts_size = trailer.texts_size;
+
+    free(return_seq->slabs[0]);
+    for (uint32_t slab = 0; slab < slabs; slab++)
+        return_seq->slabs[slab] = nodes + SEQ_SLAB_MIN_NODES * ((1U << slab) - 1);
+    return_seq->used = trailer.used;
+    return_seq->free_nodes = trailer.free_nodes;
+    return_seq->mapping = mapping;
+    return return_seq;
+}
+
+/*Opens storage saved by seq_save to file path. Nothing is read until it is
+* needed, so opening takes the same time for files of any size.
+*/
+seq_t * seq_open_mapped(char const * path) {
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    seq_t * return_seq = snap_open(fd);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return return_seq;
+}
+
+/*Makes storage p opened from a snapshot file ready to be changed: classes,
+* members and names are copied to memory and the mapping becomes writable,
+* each page of it being copied when it is first written. The file never
+* changes. Sequence of a member which does not fit in the pool of texts
+* is treated as not known. In case of allocation error returns -1
+* and leaves p as it was.
+*/
+int mapping_upgrade(seq_t * p) {
+    seq_mapping_t * mapping = p->mapping;
+    seq_classes_t * classes = &p->own_classes;
+
+    for (int i = 0; i < mapping->amount; i++) {
+        seq_snap_class_t const * record = &mapping->classes[i];
+        if (class_new(classes) == -1) {
+            classes_clear(classes);
+            return -1;
+        }
+
+        seq_class_t * current = class_at(classes, i);
+        current->parent = record->parent;
+        current->rank = record->rank;
+        current->members = record->members;
+        if (record->name != SEQ_SNAP_NO_NAME) {
+            char const * text = mapping->names + record->name;
+            if (class_rename(classes, i, text, strlen(text)) == -1) {
+                classes_clear(classes);
+                return -1;
+            }
+        }
+    }
+
+    for (uint32_t m = 0; m < mapping->member_amount; m++) {
+        seq_snap_member_t const * record = &mapping->members[m];
+        uint32_t segment = class_segment(m);
+        if (!classes->member_segments[segment]) {
+            classes->member_segments[segment] = (seq_member_t *) malloc(
+                sizeof(seq_member_t) * (SEQ_SEGMENT_MIN_CLASSES << segment)
+            );
+            if (!classes->member_segments[segment]) {
+                classes_clear(classes);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+
+        seq_member_t * member = member_at(classes, m);
+        member->text = NULL;
+        member->length = 0;
+        member->abs_class = record->abs_class;
+        member->next = record->next;
+        member->prev = record->prev;
+        member->references = 0;
+        classes->member_amount++;
+        if (record->abs_class < 0) continue;
+
+        size_t bytes = (size_t) (record->length / 4 + 1);
+        if (record->text == SEQ_SNAP_NO_NAME || record->text > mapping->texts_size
+            || bytes > mapping->texts_size - record->text) {
+            classes->unknown++;
+            continue;
+        }
+        member->text = (uint8_t *) malloc(bytes);
+        if (!member->text) {
+            classes_clear(classes);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(member->text, mapping->texts + record->text, bytes);
+        member->length = (size_t) record->length;
+    }
+    classes->free_members = mapping->free_members;
+
+    if (mprotect(mapping->base, mapping->size, PROT_READ | PROT_WRITE) == -1) {
+        classes_clear(classes);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mapping->classes = NULL;
+    mapping->members = NULL;
+    mapping->names = NULL;
+    mapping->texts = NULL;
+    return 0;
+}
+
+/*Words of a bitvector counted together by the rank directory.*/
+#define SEQ_RANK_WORDS 8
+
+/*Bitvector of size words, ranks[b] is number of bits set in words
+* before word SEQ_RANK_WORDS * b.
+*/
+typedef struct seq_bits {
+    uint64_t * words;
+    uint32_t * ranks;
+    size_t size;
+} seq_bits_t;
+
+/*Returns bit number i of bitvector bits.*/
+static inline bool bits_get(seq_bits_t const * bits, uint64_t i) {
+    return (bits->words[i / 64] >> (i % 64)) & 1;
+}
+
+/*Returns number of bits set in bitvector bits before bit number i.*/
+static inline uint64_t bits_rank(seq_bits_t const * bits, uint64_t i) {
+    uint64_t word = i / 64;
+    uint64_t rank = bits->ranks[word / SEQ_RANK_WORDS];
+    for (uint64_t w = word - word % SEQ_RANK_WORDS; w < word; w++)
+        rank += (uint64_t) __builtin_popcountll(bits->words[w]);
+    if (i % 64)
+        rank += (uint64_t) __builtin_popcountll(
+            bits->words[word] & (((uint64_t) 1 << (i % 64)) - 1)
+        );
+    return rank;
+}
+
+/*Sets bit number i of bitvector bits, making it longer if it is too short.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int bits_set(seq_bits_t * bits, uint64_t i) {
+    if (i / 64 >= bits->size) {
+        size_t size = bits->size ? 2 * bits->size : SEQ_RANK_WORDS;
+        while (i / 64 >= size) size *= 2;
+        uint64_t * words = (uint64_t *) realloc(bits->words, sizeof(uint64_t) * size);
+        if (!words) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(words + bits->size, 0, sizeof(uint64_t) * (size - bits->size));
+        bits->words = words;
+        bits->size = size;
+    }
+    bits->words[i / 64] |= (uint64_t) 1 << (i % 64);
+    return 0;
+}
+
+/*Cuts bitvector bits down to its first length bits and builds its rank
+* directory. In case of allocation error returns -1 and assigns ENOMEM
+* to errno.
+*/
+int bits_finish(seq_bits_t * bits, uint64_t length) {
+    size_t size = (size_t) ((length + 64 * SEQ_RANK_WORDS - 1) / (64 * SEQ_RANK_WORDS))
+        * SEQ_RANK_WORDS;
+    if (size != bits->size) {
+        uint64_t * words = (uint64_t *) realloc(bits->words, sizeof(uint64_t) * size);
+        if (!words) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (size > bits->size)
+            memset(words + bits->size, 0, sizeof(uint64_t) * (size - bits->size));
+        bits->words = words;
+        bits->size = size;
+    }
+
+    bits->ranks = (uint32_t *) malloc(sizeof(uint32_t) * (size / SEQ_RANK_WORDS + 1));
+    if (!bits->ranks) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint32_t rank = 0;
+    for (size_t w = 0; w < size; w++) {
+        if (w % SEQ_RANK_WORDS == 0) bits->ranks[w / SEQ_RANK_WORDS] = rank;
+        rank += (uint32_t) __builtin_popcountll(bits->words[w]);
+    }
+    bits->ranks[size / SEQ_RANK_WORDS] = rank;
+    return 0;
+}
+
+/*Tree of frozen storage, its nodes being numbered level by level and nodes
+* of one level in order of their fathers and values leading to them.
+*
+* Bit SEQ_ALPHABET * i + val of sons tells whether node number i has son
+* for value val, so that son is node 1 + rank of that bit. Bit i of named
+* tells whether node i belongs to an abstraction class; representatives of
+* classes of such nodes, in their order, are kept in classes.
+*
+* After seq_minimize nodes form a graph in which equal subtrees are one,
+* and targets is not NULL. Nodes are then numbered in order in which going
+* through the graph level by level finds them. Bit number rank of fresh
+* tells whether the son was first found through this very link; such sons
+* are numbered in order of their links like in the tree. Numbers of other
+* sons are kept in targets, width bits each, in order of their links.
+*/
+typedef struct seq_frozen {
+    seq_bits_t sons;
+    seq_bits_t named;
+    int32_t * classes;
+    seq_bits_t fresh;
+    uint64_t * targets;
+    unsigned width;
+    uint64_t nodes;
+} seq_frozen_t;
+
+/*Returns number number i of width bits each kept in words.*/
+static inline uint64_t field_get(uint64_t const * words, unsigned width, uint64_t i) {
+    uint64_t bit = i * width;
+    uint64_t value = words[bit / 64] >> (bit % 64);
+    if (bit % 64 + width > 64) value |= words[bit / 64 + 1] << (64 - bit % 64);
+    return value & ((((uint64_t) 1) << width) - 1);
+}
+
+/*Sets number number i of width bits each kept in words, which were zero.*/
+static inline void field_set(uint64_t * words, unsigned width, uint64_t i, uint64_t value) {
+    uint64_t bit = i * width;
+    words[bit / 64] |= value << (bit % 64);
+    if (bit % 64 + width > 64) words[bit / 64 + 1] |= value >> (64 - bit % 64);
+}
+
+/*Frees all memory of frozen tree f.*/
+void frozen_free(seq_frozen_t * f) {
+    free(f->sons.words);
+    free(f->sons.ranks);
+    free(f->named.words);
+    free(f->named.ranks);
+    free(f->classes);
+    free(f->fresh.words);
+    free(f->fresh.ranks);
+    free(f->targets);
+    free(f);
+}
+
+/*Frees frozen tree of storage p.*/
+void frozen_delete(seq_t * p) {
+    frozen_free(p->frozen);
+    p->frozen = NULL;
+}
+
+/*Finds number of node of sequence s of given length in frozen storage p.
+* Returns the same as pos_find.
+*/
+int frozen_find(seq_t const * p, char const * s, size_t length, uint64_t * node) {
+    seq_frozen_t const * f = p->frozen;
+    if (seq_at(s, length, 0) == SEQ_END) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *node = 0;
+    for (size_t i = 0;; i++) {
+        int val = seq_at(s, length, i);
+        if (val == SEQ_END) return 1;
+        if (val == SEQ_WRONG) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        uint64_t bit = SEQ_ALPHABET * *node + (uint64_t) val;
+        if (!bits_get(&f->sons, bit))
+            return check_str_for_inval(s, length, i + 1) == -1 ? -1 : 0;
+        uint64_t rank = bits_rank(&f->sons, bit);
+        if (!f->targets) {
+            *node = rank + 1;
+            continue;
+        }
+        uint64_t fresh = bits_rank(&f->fresh, rank);
+        *node = bits_get(&f->fresh, rank)
+            ? fresh + 1 : field_get(f->targets, f->width, rank - fresh);
+    }
+}
+
+/*Same as seq_valid_n for frozen storage p.*/
+int frozen_valid(seq_t * p, char const * s, size_t length) {
+    uint64_t node;
+    return frozen_find(p, s, length, &node);
+}
+
+/*Same as seq_get_name_n for frozen storage p.*/
+char const * frozen_get_name(seq_t * p, char const * s, size_t length) {
+    seq_frozen_t const * f = p->frozen;
+    uint64_t node;
+    int found = frozen_find(p, s, length, &node);
+    if (found == -1) return NULL;
+
+    char const * name = NULL;
+    if (found && bits_get(&f->named, node)) {
+        seq_name_t * class_name =
+            class_read_name(p->classes, f->classes[bits_rank(&f->named, node)]);
+        errno = 0;
+        if (class_name) return name_text(class_name);
+    }
+
+    errno = 0;
+    return name;
+}
+
+/*Builds frozen form of the tree of storage p, going through it level
+* by level. In case of allocation error returns NULL.
+*/
+seq_frozen_t * frozen_build(seq_t * p) {
+    seq_frozen_t * f = (seq_frozen_t *) calloc(1, sizeof(seq_frozen_t));
+    seq_pos_t * level = (seq_pos_t *) malloc(sizeof(seq_pos_t));
+    seq_pos_t * next_level = NULL;
+    size_t level_amount = 1;
+    size_t level_capacity = 1;
+    size_t next_capacity = 0;
+    size_t named = 0;
+    size_t named_capacity = 0;
+    bool failed = !f || !level;
+
+    if (level) {
+        level[0].node = 0;
+        level[0].offset = 0;
+    }
+
+    while (!failed && level_amount > 0) {
+        size_t next_amount = 0;
+        for (size_t k = 0; !failed && k < level_amount; k++) {
+            seq_pos_t pos = level[k];
+            uint64_t node = f->nodes++;
+
+            seq_node_t const * current = seq_node(p, pos.node);
+            if (!node_is_run(current) && current->abstract_class >= 0) {
+                if (named == named_capacity) {
+                    size_t capacity = named_capacity ? 2 * named_capacity : 64;
+                    int32_t * classes =
+                        (int32_t *) realloc(f->classes, sizeof(int32_t) * capacity);
+                    if (!classes) {
+                        failed = true;
+                        break;
+                    }
+                    f->classes = classes;
+                    named_capacity = capacity;
+                }
+                f->classes[named++] = class_find(p->classes,
+                    member_at(p->classes, (uint32_t) current->abstract_class)->abs_class);
+                if (bits_set(&f->named, node) == -1) failed = true;
+            }
+
+            for (int val = 0; !failed && val < SEQ_ALPHABET; val++) {
+                seq_pos_t son = pos;
+                if (!pos_next(p, &son, val)) continue;
+
+                if (next_amount == next_capacity) {
+                    size_t capacity = next_capacity ? 2 * next_capacity : 64;
+                    seq_pos_t * grown =
+                        (seq_pos_t *) realloc(next_level, sizeof(seq_pos_t) * capacity);
+                    if (!grown) {
+                        failed = true;
+                        break;
+                    }
+                    next_level = grown;
+                    next_capacity = capacity;
+                }
+                next_level[next_amount++] = son;
+                if (bits_set(&f->sons, SEQ_ALPHABET * node + (uint64_t) val) == -1) failed = true;
+            }
+        }
+
+        /*The finished level becomes place for the following one.*/
+        seq_pos_t * done = level;
+        size_t done_capacity = level_capacity;
+        level = next_level;
+        level_capacity = next_capacity;
+        level_amount = next_amount;
+        next_level = done;
+        next_capacity = done_capacity;
+        if (f->nodes > UINT32_MAX) failed = true;
+    }
+
+    free(level);
+    free(next_level);
+    if (!failed) {
+        failed = bits_finish(&f->sons, SEQ_ALPHABET * f->nodes) == -1
+            || bits_finish(&f->named, f->nodes) == -1;
+    }
+    if (failed) {
+        if (f) frozen_free(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (named > 0 && named < named_capacity) {
+        int32_t * classes = (int32_t *) realloc(f->classes, sizeof(int32_t) * named);
+        if (classes) f->classes = classes;
+    }
+    return f;
+}
+
+/*Replaces tree of storage p with its frozen form, which takes about half
+* a byte for every stored sequence, and frees the tree. Frozen storage keeps
+* its sequences and names but cannot be changed any more.
+*
+* Returns 1 if p was frozen, 0 if it already was. In case of allocation
+* error returns -1 and leaves p as it was.
+*/
+int seq_freeze(seq_t * p) {
+    if (!p || p->sharding || p->concurrent) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->frozen) return 0;
+    if (p->batch || p->snapshots) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (storage_write(p) == -1) return -1;
+    if (p->classes->unknown > 0 && members_resolve(p) == -1) return -1;
+
+    seq_frozen_t * f = frozen_build(p);
+    if (!f) return -1;
+
+    arena_clear(p);
+    if (p->mapping) {
+        munmap(p->mapping->base, p->mapping->size);
+        free(p->mapping);
+        p->mapping = NULL;
+    }
+    p->frozen = f;
+    p->generation++;
+    return 1;
+}
+
+/*Sequence of frozen storage as seen by seq_minimize: representative of its
+* class (-1 if it has none) and numbers of its sons among merged nodes,
+* SEQ_NO_SON where it has no son.
+*/
+typedef struct seq_shape {
+    int32_t abs_class;
+    uint32_t sons[SEQ_ALPHABET];
+} seq_shape_t;
+
+#define SEQ_NO_SON UINT32_MAX
+
+static inline uint64_t shape_hash(seq_shape_t const * shape) {
+    uint64_t hash = (uint32_t) shape->abs_class;
+    for (int val = 0; val < SEQ_ALPHABET; val++)
+        hash = (hash ^ shape->sons[val]) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+}
+
+/*Returns number of bytes taken by frozen tree f.*/
+size_t frozen_bytes(seq_frozen_t const * f) {
+    size_t bytes = sizeof(seq_frozen_t);
+    bytes += f->sons.size * sizeof(uint64_t)
+        + (f->sons.size / SEQ_RANK_WORDS + 1) * sizeof(uint32_t);
+    bytes += f->named.size * sizeof(uint64_t)
+        + (f->named.size / SEQ_RANK_WORDS + 1) * sizeof(uint32_t);
+    uint64_t named = bits_rank(&f->named, f->nodes);
+    bytes += named * sizeof(int32_t);
+    if (f->targets) {
+        uint64_t edges = bits_rank(&f->sons, SEQ_ALPHABET * f->nodes);
+        bytes += f->fresh.size * sizeof(uint64_t)
+            + (f->fresh.size / SEQ_RANK_WORDS + 1) * sizeof(uint32_t);
+        bytes += ((edges - (f->nodes - 1)) * f->width + 63) / 64 * sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+/*Builds frozen graph of amount merged nodes from their shapes, of which
+* named have a class and edges sons. The root is merged last.
+* In case of allocation error returns NULL.
+*/
+seq_frozen_t * frozen_graph(
+    seq_shape_t const * shapes, uint32_t amount, uint64_t named, uint64_t edges
+    ) {
+    seq_frozen_t * g = (seq_frozen_t *) calloc(1, sizeof(seq_frozen_t));
+    uint32_t * number = (uint32_t *) malloc(sizeof(uint32_t) * amount);
+    uint32_t * order = (uint32_t *) malloc(sizeof(uint32_t) * amount);
+    bool failed = !g || !number || !order;
+
+    if (!failed) {
+        g->nodes = amount;
+        g->width = 1;
+        while (g->width < 32 && ((uint64_t) 1 << g->width) < amount) g->width++;
+        g->classes = (int32_t *) malloc(sizeof(int32_t) * (named ? named : 1));
+        g->targets = (uint64_t *) calloc(
+            (edges * g->width + 63) / 64 + 1, sizeof(uint64_t)
+        );
+        failed = !g->classes || !g->targets;
+    }
+
+    if (!failed) {
+        memset(number, 0xff, sizeof(uint32_t) * amount);
+        order[0] = amount - 1;
+        number[amount - 1] = 0;
+    }
+
+    uint32_t found = 1;
+    uint64_t named_at = 0;
+    uint64_t edge = 0;
+    uint64_t other = 0;
+    for (uint32_t node = 0; !failed && node < found; node++) {
+        seq_shape_t const * shape = &shapes[order[node]];
+        if (shape->abs_class >= 0) {
+            g->classes[named_at++] = shape->abs_class;
+            if (bits_set(&g->named, node) == -1) failed = true;
+        }
+
+        for (int val = 0; !failed && val < SEQ_ALPHABET; val++) {
+            uint32_t son = shape->sons[val];
+            if (son == SEQ_NO_SON) continue;
+            if (bits_set(&g->sons, SEQ_ALPHABET * (uint64_t) node + (uint64_t) val) == -1)
+                failed = true;
+
+            if (number[son] == SEQ_NO_SON) {
+                number[son] = found;
+                order[found++] = son;
+                if (bits_set(&g->fresh, edge) == -1) failed = true;
+            }
+            else {
+                field_set(g->targets, g->width, other++, number[son]);
+            }
+            edge++;
+        }
+    }
+
+    free(number);
+    free(order);
+    if (failed || bits_finish(&g->sons, SEQ_ALPHABET * (uint64_t) amount) == -1
+        || bits_finish(&g->named, amount) == -1
+        || bits_finish(&g->fresh, edges) == -1) {
+        if (g) frozen_free(g);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return g;
+}
+
+/*Merges equal subtrees of frozen storage p, so that its nodes form
+* a directed acyclic graph in which seq_valid works as before. Subtrees
+* are equal when their sequences are the same and each of them has the same
+* class in both, so every sequence keeps its own name.
+*
+* Subtrees are merged bottom-up: nodes are taken from the last one, when
+* their sons already are merged, and looked up by their shape in a hash
+* table of merged nodes.
+*
+* Returns 1 if p became smaller, 0 if it was left as it was because the
+* graph would not be smaller or p already was minimized. In case of
+* allocation error returns -1 and leaves p as it was.
+*/
+int seq_minimize(seq_t * p) {
+    if (!p || !p->frozen) {
+        errno = EINVAL;
+        return -1;
+    }
+    seq_frozen_t * f = p->frozen;
+    if (f->targets) return 0;
+
+    uint64_t n = f->nodes;
+    size_t table_size = 64;
+    while (table_size < 2 * n) table_size *= 2;
+
+    uint32_t * merged = (uint32_t *) malloc(sizeof(uint32_t) * n);
+    seq_shape_t * shapes = (seq_shape_t *) malloc(sizeof(seq_shape_t) * n);
+    uint32_t * table = (uint32_t *) malloc(sizeof(uint32_t) * table_size);
+    if (!merged || !shapes || !table) {
+        free(merged);
+        free(shapes);
+        free(table);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(table, 0xff, sizeof(uint32_t) * table_size);
+
+    uint32_t amount = 0;
+    uint64_t named = 0;
+    uint64_t edges = 0;
+    for (uint64_t i = n; i-- > 0;) {
+        seq_shape_t shape;
+        shape.abs_class = bits_get(&f->named, i)
+            ? f->classes[bits_rank(&f->named, i)] : -1;
+
+        uint64_t son = bits_rank(&f->sons, SEQ_ALPHABET * i) + 1;
+        for (int val = 0; val < SEQ_ALPHABET; val++) {
+            shape.sons[val] = SEQ_NO_SON;
+            if (bits_get(&f->sons, SEQ_ALPHABET * i + (uint64_t) val)) shape.sons[val] = merged[son++];
+        }
+
+        size_t slot = shape_hash(&shape) & (table_size - 1);
+        while (table[slot] != SEQ_NO_SON
+            && memcmp(&shapes[table[slot]], &shape, sizeof(seq_shape_t)))
+            slot = (slot + 1) & (table_size - 1);
+
+        if (table[slot] == SEQ_NO_SON) {
+            table[slot] = amount;
+            shapes[amount++] = shape;
+            if (shape.abs_class >= 0) named++;
+            for (int val = 0; val < SEQ_ALPHABET; val++)
+                if (shape.sons[val] != SEQ_NO_SON) edges++;
+        }
+        merged[i] = table[slot];
+    }
+
+    free(merged);
+    free(table);
+    seq_frozen_t * g = frozen_graph(shapes, amount, named, edges);
+    free(shapes);
+    if (!g) return -1;
+
+    if (frozen_bytes(g) >= frozen_bytes(f)) {
+        frozen_free(g);
+        return 0;
+    }
+    frozen_free(f);
+    p->frozen = g;
+    return 1;
+}
+
+/*Subtree of old node of height at most height waiting to be laid out.*/
+typedef struct seq_layout_task {
+    uint32_t node;
+    uint32_t height;
+} seq_layout_task_t;
+
+/*Growing stack of tasks.*/
+typedef struct seq_layout_stack {
+    seq_layout_task_t * tasks;
+    size_t amount;
+    size_t capacity;
+} seq_layout_stack_t;
+
+/*Puts task for node and height on stack. In case of allocation error
+* returns -1 and assigns ENOMEM to errno.
+*/
+int layout_push(seq_layout_stack_t * stack, uint32_t node, uint32_t height) {
+    if (stack->amount == stack->capacity) {
+        size_t capacity = stack->capacity ? 2 * stack->capacity : 64;
+        seq_layout_task_t * tasks = (seq_layout_task_t *) realloc(
+            stack->tasks, sizeof(seq_layout_task_t) * capacity
+        );
+        if (!tasks) {
+            errno = ENOMEM;
+            return -1;
+        }
+        stack->tasks = tasks;
+        stack->capacity = capacity;
+    }
+    stack->tasks[stack->amount].node = node;
+    stack->tasks[stack->amount].height = height;
+    stack->amount++;
+    return 0;
+}
+
+/*Returns number of sons of node in sons, in order of their values.*/
+static inline int layout_sons(seq_node_t const * node, uint32_t * sons) {
+    int amount = 0;
+    for (int val = 0; val < (node_is_run(node) ? 1 : SEQ_ALPHABET); val++)
+        if (node->next[val]) sons[amount++] = node->next[val];
+    return amount;
+}
+
+/*Returns the number of levels of the tree of storage p, using walk
+* as stack. In case of allocation error returns 0.
+*/
+uint32_t layout_height(seq_t const * p, seq_layout_stack_t * walk) {
+    uint32_t height = 0;
+    walk->amount = 0;
+    if (layout_push(walk, 0, 1) == -1) return 0;
+
+    while (walk->amount > 0) {
+        seq_layout_task_t task = walk->tasks[--walk->amount];
+        if (task.height > height) height = task.height;
+
+        uint32_t sons[SEQ_ALPHABET];
+        int amount = layout_sons(seq_node(p, task.node), sons);
+        for (int k = 0; k < amount; k++)
+            if (layout_push(walk, sons[k], task.height + 1) == -1) return 0;
+    }
+    return height;
+}
+
+/*Puts on stack tasks for the nodes depth levels below node, each of
+* the given height, with the first of them on top. Uses walk as stack.
+*/
+int layout_frontier(
+    seq_t const * p, seq_layout_stack_t * stack, seq_layout_stack_t * walk,
+    uint32_t node, uint32_t depth, uint32_t height
+    ) {
+    walk->amount = 0;
+    if (layout_push(walk, node, 0) == -1) return -1;
+
+    while (walk->amount > 0) {
+        seq_layout_task_t task = walk->tasks[--walk->amount];
+        if (task.height == depth) {
+            if (layout_push(stack, task.node, height) == -1) return -1;
+            continue;
+        }
+
+        /*Sons go to walk in order, so the last one is reached first
+        * and the first one ends on top of stack.
+        */
+        uint32_t sons[SEQ_ALPHABET];
+        int amount = layout_sons(seq_node(p, task.node), sons);
+        for (int k = 0; k < amount; k++)
+            if (layout_push(walk, sons[k], task.height + 1) == -1) return -1;
+    }
+    return 0;
+}
+
+/*Numbers nodes of storage p in van Emde Boas order: the top half of the
+* levels of a subtree first, then every subtree hanging below it, both laid
+* out the same way. Number of old node i goes to order[i], amount of them
+* to amount. In case of allocation error returns -1.
+*/
+int layout_order(seq_t const * p, uint32_t * order, uint32_t * amount) {
+    seq_layout_stack_t stack = {NULL, 0, 0};
+    seq_layout_stack_t walk = {NULL, 0, 0};
+    int result = -1;
+
+    uint32_t levels = layout_height(p, &walk);
+    uint32_t height = 1;
+    while (height < levels) height *= 2;
+    *amount = 0;
+
+    if (levels && layout_push(&stack, 0, height) == 0) {
+        result = 0;
+        while (result == 0 && stack.amount > 0) {
+            seq_layout_task_t task = stack.tasks[--stack.amount];
+            if (task.height == 1) {
+                order[task.node] = (*amount)++;
+                continue;
+            }
+
+            uint32_t half = task.height / 2;
+            if (layout_frontier(p, &stack, &walk, task.node, half, task.height - half) == -1
+                || layout_push(&stack, task.node, half) == -1)
+                result = -1;
+        }
+    }
+
+    free(stack.tasks);
+    free(walk.tasks);
+    return result;
+}
+
+/*Copies every node of the tree of storage p to slabs, old node i
+* becoming node order[i]. In case of allocation error returns -1.
+*/
+int layout_copy(seq_t const * p, uint32_t const * order, seq_node_t * const * slabs) {
+    seq_layout_stack_t walk = {NULL, 0, 0};
+    int result = layout_push(&walk, 0, 0);
+
+    while (result == 0 && walk.amount > 0) {
+        uint32_t node = walk.tasks[--walk.amount].node;
+        seq_node_t const * old_node = seq_node(p, node);
+        seq_node_t * new_node = slabs_node(slabs, order[node]);
+
+        *new_node = *old_node;
+        for (int val = 0; result == 0 && val < (node_is_run(old_node) ? 1 : SEQ_ALPHABET); val++) {
+            uint32_t son = old_node->next[val];
+            if (!son) continue;
+            new_node->next[val] = order[son];
+            result = layout_push(&walk, son, 0);
+        }
+    }
+
+    free(walk.tasks);
+    return result;
+}
+
+/*Copies tree of storage p to new slabs in van Emde Boas order, so that
+* a walk from the root to a sequence at depth d touches about d / log B
+* blocks of B nodes, whatever B is. Nodes freed by removals are given back.
+* Cursors of p become stale. Sharded storages have each shard compacted.
+*
+* Returns 0, in case of allocation error -1 with p left as it was.
+*/
+int seq_compact(seq_t * p) {
+    if (!p || p->concurrent || p->frozen) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) {
+        int result = 0;
+        for (int i = 0; result == 0 && i <= p->sharding->amount; i++) {
+            seq_shard_t * shard = &p->sharding->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            result = seq_compact(shard->storage);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        return result;
+    }
+    if (storage_write(p) == -1) return -1;
+    if (p->snapshots) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    uint32_t * order = (uint32_t *) malloc(sizeof(uint32_t) * p->used);
+    uint32_t amount;
+    if (!order || layout_order(p, order, &amount) == -1) {
+        free(order);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    seq_node_t * slabs[SEQ_SLABS] = {NULL};
+    int result = 0;
+    for (uint32_t slab = 0; result == 0 && slab <= seq_slab(amount - 1); slab++) {
+        slabs[slab] = (seq_node_t *) malloc(
+            sizeof(seq_node_t) * (SEQ_SLAB_MIN_NODES << slab)
+        );
+        if (!slabs[slab]) result = -1;
+    }
+    if (result == 0) result = layout_copy(p, order, slabs);
+    free(order);
+    if (result == -1) {
+        for (uint32_t i = 0; i < SEQ_SLABS; i++) free(slabs[i]);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    arena_clear(p);
+    if (p->mapping) {
+        munmap(p->mapping->base, p->mapping->size);
+        free(p->mapping);
+        p->mapping = NULL;
+    }
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) p->slabs[i] = slabs[i];
+    p->used = amount;
+    p->generation++;
+    return 0;
+}
+
+/*Calls visit with every sequence of the list of members starting at first
+* in table classes, or in the records of mapping if it is not NULL, as text
+* ending with '\0', and arg. Returns 0, in case of allocation error -1
+* and assigns ENOMEM to errno.
+*/
+int members_visit(
+    seq_classes_t const * classes, seq_mapping_t const * mapping, uint32_t first,
+    void (*visit)(char const *, void *), void * arg
+    ) {
+    size_t capacity = 64;
+    char * buffer = (char *) malloc(capacity);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint32_t m = first;
+    do {
+        size_t length;
+        uint8_t const * text;
+        if (mapping) {
+            length = mapping->members[m].length;
+            text = mapping->texts + mapping->members[m].text;
+        }
+        else {
+            length = member_at(classes, m)->length;
+            text = member_at(classes, m)->text;
+        }
+
+        if (length >= capacity) {
+            char * grown = (char *) realloc(buffer, length + 1);
+            if (!grown) {
+                free(buffer);
+                errno = ENOMEM;
+                return -1;
+            }
+            buffer = grown;
+            capacity = length + 1;
+        }
+
+        for (size_t i = 0; i < length; i++)
+            buffer[i] = seq_symbol((text[i / 4] >> (2 * (i % 4))) & 3);
+        buffer[length] = '\0';
+        visit(buffer, arg);
+        m = mapping ? mapping->members[m].next : member_at(classes, m)->next;
+    } while (m != first);
+
+    free(buffer);
+    return 0;
+}
+
+/*Tells whether every member of the list starting at first in the records
+* of mapping has its sequence in the file.
+*/
+bool mapping_known(seq_mapping_t const * mapping, uint32_t first) {
+    uint32_t m = first;
+    do {
+        if (mapping->members[m].text == SEQ_SNAP_NO_NAME) return false;
+        m = mapping->members[m].next;
+    } while (m != first);
+    return true;
+}
+
+/*Same as seq_class_foreach_n for sharded storage p.*/
+int shards_class_foreach(
+    seq_t * p, char const * s, size_t length,
+    void (*visit)(char const *, void *), void * arg
+    ) {
+    int index = shard_index(p->sharding, s, length);
+    if (index == -1) return -1;
+
+    seq_shard_t * shard = &p->sharding->shards[index];
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&p->sharding->classes_lock);
+    int result = seq_class_foreach_n(shard->storage, s, length, visit, arg);
+    int error = errno;
+    classes_unlock(p);
+    pthread_mutex_unlock(&shard->lock);
+    errno = error;
+    return result;
+}
+
+/*Calls visit with every sequence in the abstraction class of sequence s
+* of given length. Sequences of members made by cursors are found first,
+* going through the whole tree once. Storage opened from a snapshot file
+* reads members from the file, unless some of them are not known there.
+*/
+int seq_class_foreach_n(
+    seq_t * p, char const * s, size_t length,
+    void (*visit)(char const * member, void * arg), void * arg
+    ) {
+    if (!p || !s || !visit || p->origin) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->sharding) return shards_class_foreach(p, s, length, visit, arg);
+
+    seq_classes_t * classes = p->classes;
+    seq_mapping_t const * mapping = p->mapping && p->mapping->classes ? p->mapping : NULL;
+    uint32_t first = SEQ_NO_MEMBER;
+    int found;
+    if (p->frozen) {
+        seq_frozen_t const * f = p->frozen;
+        uint64_t node;
+        found = frozen_find(p, s, length, &node);
+        if (found == 1 && bits_get(&f->named, node))
+            first = class_at(classes, f->classes[bits_rank(&f->named, node)])->members;
+    }
+    else if (mapping) {
+        seq_pos_t pos;
+        found = seq_find(p, s, length, &pos);
+        seq_node_t const * node = found == 1 ? seq_node(p, pos.node) : NULL;
+        if (node && !node_is_run(node) && node->abstract_class >= 0) {
+            int32_t abs_class = mapping->members[node->abstract_class].abs_class;
+            first = mapping->classes[mapping->classes[abs_class].parent].members;
+        }
+        if (first != SEQ_NO_MEMBER && !mapping_known(mapping, first)) mapping = NULL;
+    }
+    if (!p->frozen && !mapping) {
+        first = SEQ_NO_MEMBER;
+        if (storage_write(p) == -1) return -1;
+        classes = p->classes;
+        if (classes->unknown > 0 && members_resolve(p) == -1) return -1;
+
+        seq_pos_t pos;
+        found = seq_find(p, s, length, &pos);
+        seq_node_t const * node = found == 1 ? seq_node(p, pos.node) : NULL;
+        if (node && !node_is_run(node) && node->abstract_class >= 0) {
+            seq_member_t const * member =
+                member_at(classes, (uint32_t) node->abstract_class);
+            first = class_at(classes, class_find(classes, member->abs_class))->members;
+        }
+    }
+    if (found != 1) return found;
+
+    if (first != SEQ_NO_MEMBER)
+        return members_visit(classes, mapping, first, visit, arg) == -1 ? -1 : 1;
+
+    size_t end = seq_scan(s, length, 0);
+    char * text = (char *) malloc(end + 1);
+    if (!text) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(text, s, end);
+    text[end] = '\0';
+    visit(text, arg);
+    free(text);
+    return 1;
+}
+
+/*Calls visit with every sequence in the abstraction class of sequence s.*/
+int seq_class_foreach(
+    seq_t * p, char const * s,
+    void (*visit)(char const * member, void * arg), void * arg
+    ) {
+    return seq_class_foreach_n(p, s, SEQ_TERMINATED, visit, arg);
+}
+
+/*Starts a batch of merges of storage p. In case of error returns -1,
+* assigning EBUSY to errno if a batch is already started.
+*/
+int seq_equiv_begin(seq_t * p) {
+    if (!p) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p->frozen || p->origin) {
+        errno = EPERM;
+        return -1;
+    }
+    if (p->batch) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    p->batch = (seq_equiv_batch_t *) calloc(1, sizeof(seq_equiv_batch_t));
+    if (!p->batch) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/*Ends the batch of merges of storage p, if there is one, without doing them.*/
+void batch_free(seq_t * p) {
+    if (!p->batch) return;
+    free(p->batch->pairs);
+    free(p->batch);
+    p->batch = NULL;
+}
+
+/*Ends the batch of merges of storage p without doing them. Classes given
+* to sequences by seq_equiv_add stay. Returns 0, -1 if no batch is started.
+*/
+int seq_equiv_abort(seq_t * p) {
+    if (!p || !p->batch) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (p->sharding) pthread_mutex_lock(&p->sharding->classes_lock);
+    batch_free(p);
+    if (p->sharding) classes_unlock(p);
+    return 0;
+}
+
+/*Returns member of sequence s of given length at position pos in storage p,
+* cutting a run if pos is inside one. Sequence without class is put
+* in a new class without name, which cannot be told from having no class.
+* In case of error returns SEQ_NO_MEMBER.
+*/
+uint32_t pos_member(seq_t * p, seq_pos_t * pos, char const * s, size_t length) {
+    if (storage_write(p) == -1) return SEQ_NO_MEMBER;
+    if (p->concurrent) retired_collect(p);
+    if (pos_split(p, pos) == -1) return SEQ_NO_MEMBER;
+
+    seq_classes_t * classes = p->classes;
+    seq_node_t * current_node = seq_node(p, pos->node);
+    if (current_node->abstract_class != -1) return (uint32_t) current_node->abstract_class;
+
+    int new_abs_class = class_new(classes);
+    if (new_abs_class == -1) return SEQ_NO_MEMBER;
+
+    uint32_t member = member_new(classes, new_abs_class, s, length);
+    if (member == SEQ_NO_MEMBER) {
+        classes->amount--;
+        return SEQ_NO_MEMBER;
+    }
+    node_set_class(current_node, (int32_t) member);
+    return member;
+}
+
+/*Adds merge of sequences s1 and s2 of given lengths, kept in storages
+* p_1 and p_2 (p or its shards), to the batch of storage p.
+* Returns the same as seq_equiv_add_n.
+*/
+int batch_add(
+    seq_t * p, seq_t * p_1, char const * s1, size_t length_1,
+    seq_t * p_2, char const * s2, size_t length_2
+    ) {
+    seq_equiv_batch_t * batch = p->batch;
+    seq_pos_t pos_1;
+    seq_pos_t pos_2;
+    int found_1 = seq_find(p_1, s1, length_1, &pos_1);
+    if (found_1 == -1) return -1;
+    int found_2 = seq_find(p_2, s2, length_2, &pos_2);
+    if (found_2 == -1) return -1;
+
+    if (!found_1 || !found_2) return 0;
+    if (p_1->snapshots && (seq_own(p_1, s1, length_1, &pos_1) == -1
+        || seq_own(p_2, s2, length_2, &pos_2) == -1)) return -1;
+
+    /*Merging sequence with itself only puts it in a class, like pos_equiv.*/
+    if (p_1 == p_2 && pos_1.node == pos_2.node && pos_1.offset == pos_2.offset) {
+        seq_node_t const * node = seq_node(p_1, pos_1.node);
+        if (!node_is_run(node) && node->abstract_class != -1) return 0;
+        return pos_member(p_1, &pos_1, s1, length_1) == SEQ_NO_MEMBER ? -1 : 1;
+    }
+
+    if (batch->amount == batch->capacity) {
+        size_t capacity = batch->capacity ? 2 * batch->capacity : 64;
+        seq_equiv_pair_t * pairs = (seq_equiv_pair_t *) realloc(
+            batch->pairs, sizeof(seq_equiv_pair_t) * capacity
+        );
+        if (!pairs || batch->amount >= INT32_MAX) {
+            if (pairs) batch->pairs = pairs;
+            errno = ENOMEM;
+            return -1;
+        }
+        batch->pairs = pairs;
+        batch->capacity = capacity;
+    }
+
+    /*Making the first member may cut a run holding the second sequence,
+    * so it is found again.
+    */
+    uint32_t member_1 = pos_member(p_1, &pos_1, s1, length_1);
+    if (member_1 == SEQ_NO_MEMBER) return -1;
+    seq_find(p_2, s2, length_2, &pos_2);
+    uint32_t member_2 = pos_member(p_2, &pos_2, s2, length_2);
+    if (member_2 == SEQ_NO_MEMBER) return -1;
+
+    batch->pairs[batch->amount].member_1 = member_1;
+    batch->pairs[batch->amount].member_2 = member_2;
+    batch->amount++;
+    return 1;
+}
+
+/*Same as seq_equiv_add_n for sharded storage p.*/
+int shards_equiv_add(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+    ) {
+    seq_sharding_t * sharding = p->sharding;
+    int index_1 = shard_index(sharding, s1, length_1);
+    if (index_1 == -1) return -1;
+    int index_2 = shard_index(sharding, s2, length_2);
+    if (index_2 == -1) return -1;
+
+    seq_shard_t * shard_1 = &sharding->shards[index_1];
+    seq_shard_t * shard_2 = &sharding->shards[index_2];
+    pthread_mutex_lock(&sharding->shards[index_1 < index_2 ? index_1 : index_2].lock);
+    if (index_1 != index_2)
+        pthread_mutex_lock(&sharding->shards[index_1 < index_2 ? index_2 : index_1].lock);
+    pthread_mutex_lock(&sharding->classes_lock);
+
+    int result = batch_add(
+        p, shard_1->storage, s1, length_1, shard_2->storage, s2, length_2
+    );
+    int error = errno;
+
+    classes_unlock(p);
+    if (index_1 != index_2) pthread_mutex_unlock(&shard_2->lock);
+    pthread_mutex_unlock(&shard_1->lock);
+    errno = error;
+    return result;
 }
 
-/*Check if there are any illegal values in sequence.
-* In such case returns -1 and turns errno to EINVAL.
-* For correct sequences returns 0.
+/*Adds merge of classes of sequences s1 and s2 of given lengths
+* to the batch of storage p.
 */
-int check_str_for_inval(char const * s) {
-    if (!s) {
-        errno = EINVAL;
-        return -1;
-    }
-    
-    int length = (int) strlen(s);
-    if (!length) {
+int seq_equiv_add_n(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+    ) {
+    if (!p || !s1 || !s2 || !p->batch) {
         errno = EINVAL;
         return -1;
     }
+    if (p->sharding) return shards_equiv_add(p, s1, length_1, s2, length_2);
+    return batch_add(p, p, s1, length_1, p, s2, length_2);
+}
 
-    for (int i = 0; i < length; i++) {
-        char current_num = s[i];
-        if (current_num != '0' && current_num != '1' && current_num != '2') {
-            errno = EINVAL;
-            return -1;
-        }
-    }
-    return 0;
+/*Adds merge of classes of sequences s1 and s2 to the batch of storage p.*/
+int seq_equiv_add(seq_t * p, char const * s1, char const * s2) {
+    return seq_equiv_add_n(p, s1, SEQ_TERMINATED, s2, SEQ_TERMINATED);
 }
 
-/*Checks if given node has any sons.
+/*Name of a class while a batch is committed: one of the names already
+* in the table (left is then -1) or name left followed by name right.
+* hash and power are counted as for names, so that names with different
+* hashes are surely different.
 */
-bool check_seq_for_next(seq_t * p, char val) {
-    if (val == '0' && p->next_zero) return true;
-    if (val == '1' && p->next_one) return true;
-    if (val == '2' && p->next_two) return true;
-    return false;
-}
+typedef struct seq_rope {
+    int32_t left;
+    int32_t right;
+    seq_name_t * name;
+    size_t length;
+    uint64_t hash;
+    uint64_t power;
+} seq_rope_t;
 
-/*Tries to add son to node p in storage.
+/*Classes taking part in a commit, numbered by their local number.
 *
-* If son already exists returns 0 and does not do anything.
+* classes[l] is the representative of class l in the table, parent
+* and ropes make the forest of local classes being merged: names[l]
+* is the name of local class l if it is a root, -1 if it has none.
 *
-* In case of malloc error returns -1 and assigns ENOMEM to errno.
+* keys is hash table of capacity slots (a power of two) leading from
+* a representative to its local number plus one, 0 in empty slots.
 */
-int new_seq_node(seq_t * p, char new_val) {
-    if (new_val != '0' && new_val != '1' && new_val != '2') {
-        errno = EINVAL;
-        return -1;
-    }
+typedef struct seq_commit {
+    int * classes;
+    uint32_t * parent;
+    int32_t * names;
+    seq_rope_t * ropes;
+    uint32_t * keys;
+    size_t capacity;
+    uint32_t amount;
+    uint32_t rope_amount;
+} seq_commit_t;
 
-    if (check_seq_for_next(p, new_val)) return 0;
-
-    seq_t * temp = (seq_t *) malloc(sizeof(seq_t));
-    
-    if (temp == NULL) {
-        errno = ENOMEM;
-        return -1;
+/*Returns local number of class with representative abs_class,
+* giving it the next one if it has none yet.
+*/
+uint32_t commit_local(seq_commit_t * c, seq_classes_t const * classes, int abs_class) {
+    size_t slot = ((uint64_t) (uint32_t) abs_class * 0x9E3779B97F4A7C15ULL)
+        & (c->capacity - 1);
+    while (c->keys[slot]) {
+        uint32_t local = c->keys[slot] - 1;
+        if (c->classes[local] == abs_class) return local;
+        slot = (slot + 1) & (c->capacity - 1);
     }
 
-    temp->abstract_class_name = NULL;
-    temp->abstract_class = -1;
-    temp->abstract_classes_amount = p->abstract_classes_amount;
-    temp->next_one = NULL;
-    temp->next_two = NULL;
-    temp->next_zero = NULL;
-
-    if (new_val == '0') p->next_zero = temp;
-    if (new_val == '1') p->next_one = temp;
-    if (new_val == '2') p->next_two = temp;
+    uint32_t local = c->amount++;
+    c->keys[slot] = local + 1;
+    c->classes[local] = abs_class;
+    c->parent[local] = local;
+    c->names[local] = -1;
 
-    return 1;
+    seq_name_t * name = class_at(classes, abs_class)->name;
+    if (name) {
+        seq_rope_t * rope = &c->ropes[c->rope_amount];
+        rope->left = -1;
+        rope->right = -1;
+        rope->name = name;
+        rope->length = name->length;
+        rope->hash = name->hash;
+        rope->power = name->power;
+        c->names[local] = (int32_t) c->rope_amount++;
+    }
+    return local;
 }
 
-/*Return next node representing 0 1 2*/
-seq_t * next_seq(seq_t * p, char next_char) {
-    if (!p) return NULL;
-    switch (next_char) {
-        case '0':
-            if (p->next_zero) return p->next_zero;
-            break;
-        
-        case '1':
-            if (p->next_one) return p->next_one;
-            break;
-
-        case '2':
-            if (p->next_two) return p->next_two;
-            break;
-        
-        default:
-            return NULL;
+/*Returns root of local class local, attaching classes on the way to it.*/
+uint32_t commit_find(seq_commit_t * c, uint32_t local) {
+    uint32_t root = local;
+    while (c->parent[root] != root) root = c->parent[root];
+    while (c->parent[local] != root) {
+        uint32_t next = c->parent[local];
+        c->parent[local] = root;
+        local = next;
     }
-    return NULL;
+    return root;
 }
 
-/*Deleting sequence ending on node p and all sequences which have it as prefix recursively.
+/*Writes text of rope number rope to text, using stack, which has room
+* for every rope of c. In case of allocation error returns -1
+* and assigns ENOMEM to errno.
 */
-void seq_remove_recur(seq_t * p) {
-    if (p != NULL) {
-        if (p->next_zero != NULL) {
-            seq_remove_recur(p->next_zero);
-            p->next_zero = NULL;
-        }
-        if (p->next_one != NULL) {
-            seq_remove_recur(p->next_one);
-            p->next_one = NULL;
-        }
-        if (p->next_two) {
-            seq_remove_recur(p->next_two);
-            p->next_two = NULL;
+int rope_flatten(seq_commit_t const * c, int32_t rope, char * text, int32_t * stack) {
+    size_t written = 0;
+    size_t amount = 0;
+    stack[amount++] = rope;
+    while (amount > 0) {
+        seq_rope_t const * current = &c->ropes[stack[--amount]];
+        if (current->left == -1) {
+            char const * part = name_text(current->name);
+            if (!part) return -1;
+            memcpy(text + written, part, current->length);
+            written += current->length;
+            continue;
         }
-
-        if (p->abstract_class_name) free(p->abstract_class_name);
-        p->abstract_classes_amount = NULL;
-        free(p);
+        stack[amount++] = current->right;
+        stack[amount++] = current->left;
     }
+    return 0;
 }
 
-/*Adds to storage sequence s and all of its prefixes.
-* In case of allocation error deletes all already added sequences in procedure.
+/*Tells whether ropes number a and b of c have the same text. Texts
+* with equal hashes are compared in buffers from text.
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
 */
-int seq_add(seq_t * p, char const * s) {
-    if (!p) {
-        errno = EINVAL;
+int rope_equal(seq_commit_t const * c, int32_t a, int32_t b, int32_t * stack) {
+    seq_rope_t const * rope_a = &c->ropes[a];
+    seq_rope_t const * rope_b = &c->ropes[b];
+    if (a == b) return 1;
+    if (rope_a->length != rope_b->length || rope_a->hash != rope_b->hash) return 0;
+    if (rope_a->left == -1 && rope_b->left == -1) return rope_a->name == rope_b->name;
+
+    char * text = (char *) malloc(2 * rope_a->length);
+    if (!text) {
+        errno = ENOMEM;
         return -1;
     }
-    if (!s) {
+    int equal = -1;
+    if (rope_flatten(c, a, text, stack) == 0
+        && rope_flatten(c, b, text + rope_a->length, stack) == 0)
+        equal = !memcmp(text, text + rope_a->length, rope_a->length);
+    free(text);
+    return equal;
+}
+
+/*Does every merge from the batch of storage p, as if seq_equiv was called
+* for each pair in the same order right now, and ends the batch.
+*
+* Pairs are first merged among local classes, where names are joined
+* as ropes and compared by their hashes. Then joins of merged names are
+* made in the table and the class table is changed in one pass. Returns
+* how many pairs merged two different classes. In case of allocation
+* error returns -1 and leaves the batch and p as they were.
+*/
+int seq_equiv_commit(seq_t * p) {
+    if (!p || !p->batch) {
         errno = EINVAL;
         return -1;
     }
 
-    int length = (int) strlen(s);
-    int added_seqs = 0;
+    seq_equiv_batch_t * batch = p->batch;
+    seq_classes_t * classes = p->classes;
+    if (p->sharding) pthread_mutex_lock(&p->sharding->classes_lock);
 
-    if (check_str_for_inval(s) == -1) return -1;
-    
-    seq_t * first_added_seq = NULL;
-    seq_t * current_seq_node = p;
-    seq_t * second_to_last = p;
-    int first_index = 0;
-
-    for (int i = 0; i < length; i++) {
-        int current_adding_result = new_seq_node(current_seq_node, s[i]);
-        if (first_added_seq == NULL && current_adding_result == 1) {
-            second_to_last = current_seq_node;
-            first_index = i;
-            first_added_seq = next_seq(current_seq_node, s[i]);
-        }
-
-        if (current_adding_result == -1) {
-            if (first_added_seq) {
-                seq_remove_recur(first_added_seq);
-                switch (s[first_index]) {
-                    case '0':
-                        second_to_last->next_zero = NULL;
-                        break;
-        
-                    case '1':
-                        second_to_last->next_one = NULL;
-                        break;
+    size_t most = 2 * batch->amount;
+    size_t rope_most = most + batch->amount + 1;
+    seq_commit_t c;
+    c.capacity = 16;
+    while (c.capacity < 2 * most) c.capacity *= 2;
+    c.classes = (int *) malloc(sizeof(int) * (most + 1));
+    c.parent = (uint32_t *) malloc(sizeof(uint32_t) * (most + 1));
+    c.names = (int32_t *) malloc(sizeof(int32_t) * (most + 1));
+    c.ropes = (seq_rope_t *) malloc(sizeof(seq_rope_t) * rope_most);
+    c.keys = (uint32_t *) calloc(c.capacity, sizeof(uint32_t));
+    c.amount = 0;
+    c.rope_amount = 0;
+    int32_t * stack = (int32_t *) malloc(sizeof(int32_t) * rope_most);
+    seq_name_t ** merged_names = NULL;
+    seq_name_t ** built = NULL;
+    int merged = 0;
+    bool failed = !c.classes || !c.parent || !c.names || !c.ropes || !c.keys || !stack;
 
-                    case '2':
-                        second_to_last->next_two = NULL;
-                        break;
-            }
-            }
-            errno = ENOMEM;
-            return -1;
+    for (size_t k = 0; !failed && k < batch->amount; k++) {
+        seq_equiv_pair_t pair = batch->pairs[k];
+        uint32_t local_1 = commit_local(&c, classes,
+            class_find(classes, member_at(classes, pair.member_1)->abs_class));
+        uint32_t local_2 = commit_local(&c, classes,
+            class_find(classes, member_at(classes, pair.member_2)->abs_class));
+        uint32_t root_1 = commit_find(&c, local_1);
+        uint32_t root_2 = commit_find(&c, local_2);
+        if (root_1 == root_2) continue;
+
+        /*Names are joined the way pos_equiv joins them.*/
+        int32_t name_1 = c.names[root_1];
+        int32_t name_2 = c.names[root_2];
+        int32_t name_n = name_2;
+        if (name_1 != -1 && name_2 != -1) {
+            int equal = rope_equal(&c, name_1, name_2, stack);
+            if (equal == -1) failed = true;
+            name_n = equal == 1 ? name_1 : (int32_t) c.rope_amount;
         }
-        else {
-            added_seqs += current_adding_result;
-            current_seq_node = next_seq(current_seq_node, s[i]);
+        else if (name_1 != -1) {
+            name_n = name_1;
         }
-        
+        if (name_n == (int32_t) c.rope_amount) {
+            seq_rope_t * rope = &c.ropes[c.rope_amount++];
+            rope->left = name_1;
+            rope->right = name_2;
+            rope->name = NULL;
+            rope->length = c.ropes[name_1].length + c.ropes[name_2].length;
+            rope->hash = c.ropes[name_1].hash * c.ropes[name_2].power
+                + c.ropes[name_2].hash;
+            rope->power = c.ropes[name_1].power * c.ropes[name_2].power;
+        }
+
+        c.parent[root_2] = root_1;
+        c.names[root_1] = name_n;
+        merged++;
     }
-    
-    return added_seqs > 0;
-    
-}
 
-/*Deletes sequence s from structure and all sequences for which s is a prefix.*/
-int seq_remove(seq_t * p, char const * s) {
-    if (!p) {
-        errno = EINVAL;
-        return -1;
+    /*Joins are made in the order of their ropes, parts first, so that
+    * nothing can fail when classes are changed. Each made join is held
+    * until the end, merged names get one more reference for their class.
+    */
+    if (!failed) {
+        built = (seq_name_t **) calloc(c.rope_amount + 1, sizeof(seq_name_t *));
+        merged_names = (seq_name_t **) calloc(c.amount + 1, sizeof(seq_name_t *));
+        failed = !built || !merged_names;
     }
-    seq_t * current_seq = p;
-    
-    if (check_str_for_inval(s) == -1) return -1;
-    int length = (int) strlen(s);
-    seq_t * second_to_last = p;
+    for (uint32_t r = 0; !failed && r < c.rope_amount; r++) {
+        seq_rope_t const * rope = &c.ropes[r];
+        if (rope->left == -1) {
+            built[r] = rope->name;
+            continue;
+        }
+        built[r] = name_join(&classes->names, built[rope->left], built[rope->right]);
+        if (!built[r]) failed = true;
+    }
+    for (uint32_t l = 0; !failed && l < c.amount; l++)
+        if (class_own(classes, c.classes[l]) == -1) failed = true;
+
+    if (failed) {
+        errno = ENOMEM;
+    }
+    else {
+        for (uint32_t l = 0; l < c.amount; l++) {
+            uint32_t root = commit_find(&c, l);
+            if (root == l && c.names[l] != -1) {
+                merged_names[l] = built[c.names[l]];
+                merged_names[l]->references++;
+            }
+        }
 
+        /*All classes of a merged class get its name before they are
+        * joined, so that readers never see a class without it. Clearing
+        * names of old representatives is left to class_root_name as in
+        * pos_equiv.
+        */
+        for (uint32_t l = 0; l < c.amount; l++)
+            class_set_name(classes, c.classes[l], merged_names[commit_find(&c, l)]);
 
+        for (uint32_t l = 0; l < c.amount; l++) {
+            uint32_t root = commit_find(&c, l);
+            if (root == l) continue;
 
-    for (int i = 0; i < length; i++) {
-        if (i == length - 1) {
-            second_to_last = current_seq;
+            int abs_class_1 = class_find(classes, c.classes[root]);
+            int abs_class_2 = c.classes[l];
+            int abs_class_n = class_union(classes, abs_class_1, abs_class_2);
+            int abs_class_old = abs_class_n == abs_class_1 ? abs_class_2 : abs_class_1;
+            class_set_name(classes, abs_class_old, NULL);
+            members_splice(classes, abs_class_n, abs_class_old);
         }
 
-        if (!check_seq_for_next(current_seq, s[i])) return 0;
-        current_seq = next_seq(current_seq, s[i]); 
-    }
-    
-    seq_remove_recur(current_seq);
-    switch (s[length - 1]) {
-        case '0':
-            second_to_last->next_zero = NULL;
-            break;
-        
-        case '1':
-            second_to_last->next_one = NULL;
-            break;
+        for (size_t r = 0; r < c.rope_amount; r++)
+            if (c.ropes[r].left == -1) name_release(&classes->names, c.ropes[r].name);
 
-        case '2':
-            second_to_last->next_two = NULL;
-            break;
+        batch_free(p);
     }
+    for (uint32_t r = 0; built && r < c.rope_amount; r++)
+        if (c.ropes[r].left != -1 && built[r]) name_release(&classes->names, built[r]);
 
-    return 1;
-}
-
-/*Deletes whole storage and frees memory used by it.*/
-void seq_delete(seq_t * p) {
-    if (p) {
-        seq_remove(p, "0");
-        seq_remove(p, "1");
-        seq_remove(p, "2");
-        free(p->abstract_classes_amount);
-        if (p->abstract_class_name)
-            free(p->abstract_class_name);
-        free(p);
-        p = NULL;
-    }
+    if (p->sharding) classes_unlock(p);
+    free(c.classes);
+    free(c.parent);
+    free(c.names);
+    free(c.ropes);
+    free(c.keys);
+    free(stack);
+    free(merged_names);
+    free(built);
+    return failed ? -1 : merged;
 }
 
-/*Checks if sequence s is stored in storage p.*/
-int seq_valid(seq_t * p, char const * s) {
-    if (check_str_for_inval(s) == -1) return -1;
-    if (!p) {
-        errno = EINVAL;
-        return -1;
-    }
-    
-    seq_t * current_seq = p;
-    int length = (int) strlen(s);
+/*Shares every segment of table classes that holds classes with table copy
+* made for a snapshot, which gets the same classes and members.
+* In case of allocation error returns -1, assigns ENOMEM to errno
+* and changes nothing.
+*/
+int classes_share(seq_classes_t * classes, seq_classes_t * copy) {
+    seq_share_t * made[SEQ_SEGMENTS] = {NULL};
 
-     for (int i = 0; i < length; i++) {
-        if (!check_seq_for_next(current_seq, s[i])) return 0;
-        current_seq = next_seq(current_seq, s[i]);  
-    } 
-    return 1;
-}
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        uint32_t start = (SEQ_SEGMENT_MIN_CLASSES << i) - SEQ_SEGMENT_MIN_CLASSES;
+        if (!classes->segments[i] || classes->shares[i]) continue;
+        if ((uint32_t) classes->amount <= start) continue;
 
-/* Changes name of sequence in storage or gives it name if it does not have one.*/
-int replace_or_set_seq_name(seq_t * p, char const * n) {
-    int n_length = strlen(n) + 1;
-    if (p) {
-        if (p->abstract_class_name) {
-            free(p->abstract_class_name);
-            p->abstract_class_name = NULL;
-        }    
-        
-        p->abstract_class_name = (char *) malloc(sizeof(char) * n_length);
-        if (!p->abstract_class_name) {
+        made[i] = (seq_share_t *) malloc(sizeof(seq_share_t));
+        if (!made[i]) {
+            for (uint32_t j = 0; j < i; j++) free(made[j]);
             errno = ENOMEM;
             return -1;
         }
 
-        strcpy(p->abstract_class_name, n);
-            
-        return 1;
-        
+        uint32_t used = (uint32_t) classes->amount - start;
+        if (used > SEQ_SEGMENT_MIN_CLASSES << i) used = SEQ_SEGMENT_MIN_CLASSES << i;
+        made[i]->references = 1;
+        made[i]->used = used;
+    }
+
+    *copy = *classes;
+    copy->names.buckets = NULL;
+    copy->names.bucket_amount = 0;
+    copy->names.amount = 0;
+    copy->names.retired = NULL;
+    copy->names.spare.regions = NULL;
+    copy->names.spare.region_amount = 0;
+    copy->names.spare.region_capacity = 0;
+    copy->names.spare.next = NULL;
+    copy->names.spare.end = NULL;
+    for (uint32_t i = 0; i < SEQ_SPARE_CLASSES; i++) copy->names.spare.free[i] = NULL;
+    copy->names.spare.fallbacks = 0;
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        if (made[i]) classes->shares[i] = made[i];
+        if (classes->shares[i]) classes->shares[i]->references++;
+        copy->shares[i] = classes->shares[i];
     }
     return 0;
 }
 
-/*Goes over whole storage changing every sequence from current_abs_class
-* same name n.
+/*Gives back segments of classes which snapshot with table copy shared
+* with storage p. Segment nobody else uses is freed, with references
+* of the names in it.
 */
-int recur_seq_name(seq_t * p, char const * n, int current_abs_class) {
-    int next_zero;
-    int next_one;
-    int next_two;
-
-    if (!p) return 0;
-    else {
-        next_zero = recur_seq_name(p->next_zero, n, current_abs_class);
-        next_one = recur_seq_name(p->next_one, n, current_abs_class);
-        next_two = recur_seq_name(p->next_two, n, current_abs_class);
-    
-        if (next_zero == -1 || next_one == -1 || next_two == -1) return -1;
+void classes_unshare(seq_t * p, seq_classes_t * copy) {
+    seq_classes_t * classes = p->classes;
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        seq_share_t * share = copy->shares[i];
+        if (!share) continue;
 
-        if (p->abstract_class == current_abs_class)
-            return (replace_or_set_seq_name(p, n) == 1);
-
-        else return 1;
+        if (--share->references == 0) {
+            for (uint32_t j = 0; j < share->used; j++) {
+                seq_name_t * name = copy->segments[i][j].name;
+                if (name) name_release(&classes->names, name);
+            }
+            free(copy->segments[i]);
+            free(share);
+        }
+        else if (share->references == 1 && classes->shares[i] == share) {
+            classes->shares[i] = NULL;
+            free(share);
+        }
     }
 }
 
-/*Changes sequence s's name to n. Switches to this name for every sequence
-* in the same abstraction class.
+/*Takes snapshot of storage p, in constant time.
+*
+* Snapshot gets its own root, a copy of the root of p, so that p never
+* has to copy its root. Everything else is shared: the tree through
+* counts of parents, classes segment by segment. Its table of classes
+* reads members of p, which are never given back while a node of
+* a snapshot keeps them.
 */
-int seq_set_name(seq_t * p, char const * s, char const * n) {
-    if (!p) {
+seq_t * seq_snapshot(seq_t * p) {
+    if (!p || p->sharding || p->concurrent || p->frozen || p->origin) {
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
+    if (storage_write(p) == -1) return NULL;
 
-    if (check_str_for_inval(s) == -1) return -1;
+    seq_t * snapshot = (seq_t *) malloc(sizeof(seq_t));
+    if (!snapshot) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    if (!n) {    
-        errno = EINVAL;
-        return -1;
+    p->snapshots++;
+    bool failed = false;
+    for (uint32_t i = 0; !failed && i < SEQ_SLABS; i++)
+        if (p->slabs[i] && counts_ensure(p, i) == -1) failed = true;
+    uint32_t root = failed ? 0 : arena_node(p);
+    if (!root || classes_share(p->classes, &snapshot->own_classes) == -1) {
+        if (root) arena_release(p, root);
+        if (--p->snapshots == 0) counts_clear(p);
+        free(snapshot);
+        errno = ENOMEM;
+        return NULL;
     }
-    
-    seq_t * current_seq = p;
-    int length = (int) strlen(s);
-    int n_length = (int) strlen(n) + 1;
-    
-    if (!(n_length - 1)) {    
-        errno = EINVAL;
-        return -1;
+
+    seq_node_t const * original = seq_node(p, 0);
+    *seq_node(p, root) = *original;
+    for (int val = 0; val < (node_is_run(original) ? 1 : SEQ_ALPHABET); val++)
+        if (original->next[val]) (*node_count(p, original->next[val]))++;
+
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) {
+        snapshot->slabs[i] = p->slabs[i];
+        snapshot->counts[i] = NULL;
     }
+    snapshot->used = p->used;
+    snapshot->free_nodes = 0;
+    snapshot->classes = &snapshot->own_classes;
+    snapshot->compressed = p->compressed;
+    snapshot->concurrent = false;
+    snapshot->generation = 0;
+    snapshot->retired = NULL;
+    snapshot->retired_amount = 0;
+    snapshot->retired_capacity = 0;
+    snapshot->pools = NULL;
+    snapshot->pools_block = NULL;
+    snapshot->sharding = NULL;
+    snapshot->mapping = NULL;
+    snapshot->frozen = NULL;
+    snapshot->batch = NULL;
+    snapshot->root = root;
+    snapshot->snapshots = 0;
+    snapshot->origin = p;
+    snapshot->fallbacks = 0;
+#ifdef SEQ_INSTRUMENT
+    memset(snapshot->ops, 0, sizeof(snapshot->ops));
+#endif
+
+    p->generation++;
+    return snapshot;
+}
 
-    for (int i = 0; i < length; i++) {
-        if (!check_seq_for_next(current_seq, s[i])) return 0;
-        current_seq = next_seq(current_seq, s[i]);  
-    } 
+/*Deletes snapshot p, giving back to its origin what nobody else sees.*/
+void snapshot_delete(seq_t * p) {
+    seq_t * origin = p->origin;
+    seq_remove_recur(origin, p->root);
+    classes_unshare(origin, &p->own_classes);
+    if (--origin->snapshots == 0) counts_clear(origin);
+    origin->generation++;
+    free(p);
+}
+
+/*Allocates segments of table classes, so that classes and members
+* up to more after those given out so far have their records.
+*
+* In case of allocation error returns -1 and assigns ENOMEM to errno.
+*/
+int classes_reserve(seq_classes_t * classes, size_t more) {
+    uint64_t last_class = (uint64_t) classes->amount + more - 1;
+    uint64_t last_member = (uint64_t) classes->member_amount + more - 1;
+    if (last_class > INT32_MAX - 1) last_class = INT32_MAX - 1;
+    if (last_member > SEQ_NO_MEMBER - 1) last_member = SEQ_NO_MEMBER - 1;
 
-    int current_abs_class = current_seq->abstract_class;
-    if (current_abs_class == -1) {
-        current_seq->abstract_class_name =
-            (char *) malloc(sizeof(char) * n_length);
-        
-        if (!current_seq->abstract_class_name) {
+    uint32_t last = class_segment((uint32_t) last_class);
+    for (uint32_t i = class_segment((uint32_t) classes->amount); i <= last; i++) {
+        if (classes->segments[i]) continue;
+        classes->segments[i] = (seq_class_t *) malloc(
+            sizeof(seq_class_t) * (SEQ_SEGMENT_MIN_CLASSES << i)
+        );
+        if (!classes->segments[i]) {
             errno = ENOMEM;
             return -1;
-        } 
-        else {
-            for (int i = 0; i < n_length; i++) {
-                (current_seq->abstract_class_name)[i] = n[i];
-            }   
         }
-    
-        current_abs_class = *current_seq->abstract_classes_amount;
-        *current_seq->abstract_classes_amount += 1;
-        current_seq->abstract_class = *current_seq->abstract_classes_amount;
-        return 1;
     }
-    else {
-        char * current_name =  current_seq->abstract_class_name;
-        if (current_name && !strcmp(n, current_name)) return 0;
-        return recur_seq_name(p, n, current_abs_class);
+
+    last = class_segment((uint32_t) last_member);
+    if (last >= SEQ_SEGMENTS) last = SEQ_SEGMENTS - 1;
+    for (uint32_t i = class_segment(classes->member_amount); i <= last; i++) {
+        if (classes->member_segments[i]) continue;
+        classes->member_segments[i] = (seq_member_t *) malloc(
+            sizeof(seq_member_t) * (SEQ_SEGMENT_MIN_CLASSES << i)
+        );
+        if (!classes->member_segments[i]) {
+            errno = ENOMEM;
+            return -1;
+        }
     }
+    return 0;
 }
 
-/*Returns name of sequence s from storage p.*/
-char const * seq_get_name(seq_t * p, char const * s) {
-    if (!p) {
+/*Puts aside slabs for nodes, segments for as many classes and members,
+* buckets and spare memory for names of name_bytes bytes together.
+*
+* Nodes on the free list and in pools of concurrent storage are not
+* counted, so more nodes than asked for may be put aside. Every name takes
+* at least smallest bytes, which limits how many buckets names can need.
+*/
+int seq_reserve(seq_t * p, size_t nodes, size_t name_bytes) {
+    if (!p || p->sharding) {
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
+    if (storage_write(p) == -1) return -1;
 
-    if (check_str_for_inval(s) == -1) return NULL;
-    seq_t * current_seq = p;
-    int length = (int) strlen(s);
+    if (nodes > 0) {
+        uint32_t used = __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+        if (nodes > (size_t) (UINT32_MAX - used)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        uint32_t last = seq_slab((uint32_t) (used + nodes - 1));
+        if (last >= SEQ_SLABS) {
+            errno = ENOMEM;
+            return -1;
+        }
 
-    for (int i = 0; i < length; i++) {
-        if (!check_seq_for_next(current_seq, s[i])) {
-            errno = 0;
-            return NULL;
+        for (uint32_t slab = seq_slab(used); slab <= last; slab++) {
+            if (p->concurrent) {
+                if (slab_ensure(p, slab) == -1) return -1;
+                continue;
+            }
+            if (!p->slabs[slab]) {
+                p->slabs[slab] = (seq_node_t *) malloc(
+                    sizeof(seq_node_t) * (SEQ_SLAB_MIN_NODES << slab)
+                );
+                if (!p->slabs[slab]) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+            }
+            if (p->snapshots && counts_ensure(p, slab) == -1) return -1;
         }
-        current_seq = next_seq(current_seq, s[i]);  
+        if (classes_reserve(p->classes, nodes) == -1) return -1;
     }
 
-    if (current_seq && !current_seq->abstract_class_name) {
-        errno = 0;
-        return NULL;
-    } else {
-        return current_seq->abstract_class_name;
+    if (name_bytes > 0) {
+        seq_names_t * names = &p->classes->names;
+        size_t smallest = spare_units(sizeof(seq_name_t) + sizeof(char)) * SEQ_SPARE_UNIT;
+        size_t most = names->amount + name_bytes / smallest;
+        while (names->bucket_amount <= most) {
+            size_t before = names->bucket_amount;
+            names_grow(names);
+            if (names->bucket_amount == before) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        if (spare_grow(&names->spare, name_bytes) == -1) return -1;
     }
+    return 0;
 }
 
-/*Copies string with name n and returns it.*/
-char * singular_name(char const * n) {
-    int n_len = (int) strlen(n);
-
-    char * new_name = (char *)malloc(sizeof(int) * (n_len + 1));
-    if (new_name == NULL) {
-        errno = ENOMEM;
-        return NULL;
+/*Returns how many times storage p called malloc for nodes, classes,
+* members or names, shards of sharded storage and their classes together.
+*/
+size_t seq_fallbacks(seq_t * p) {
+    if (!p) {
+        errno = EINVAL;
+        return 0;
     }
 
-    if (n) {
-        strcpy(new_name, n);
+    uint64_t fallbacks = __atomic_load_n(&p->fallbacks, __ATOMIC_RELAXED);
+    if (p->sharding) {
+        seq_sharding_t * sharding = p->sharding;
+        for (int i = 0; i <= sharding->amount; i++) {
+            pthread_mutex_lock(&sharding->shards[i].lock);
+            fallbacks += sharding->shards[i].storage->fallbacks;
+            pthread_mutex_unlock(&sharding->shards[i].lock);
+        }
+        pthread_mutex_lock(&sharding->classes_lock);
+        fallbacks += p->classes->names.spare.fallbacks;
+        classes_unlock(p);
     }
-
-    return new_name;
+    else {
+        fallbacks += p->classes->names.spare.fallbacks;
+    }
+    return (size_t) fallbacks;
 }
 
-/*Combines two strings with name of sequences into one string.*/
-char * merge_names(char const * n1, char const * n2) {
-    int new_name_length = 1;
-    int n1_len = 0;
-    int n2_len = 0;
-
-    if (n1) {
-        n1_len = (int)strlen(n1);
-        new_name_length += n1_len;
-    }
-    if (n2) {
-        n2_len = (int)strlen(n2);
-        new_name_length += n2_len;
+/*Returns how many bytes of memory table classes keeps, dropped names
+* waiting in concurrent storage not counted.
+*/
+size_t classes_bytes(seq_classes_t const * classes) {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < SEQ_SEGMENTS; i++) {
+        if (classes->segments[i])
+            bytes += sizeof(seq_class_t) * (SEQ_SEGMENT_MIN_CLASSES << i);
+        if (classes->member_segments[i])
+            bytes += sizeof(seq_member_t) * (SEQ_SEGMENT_MIN_CLASSES << i);
     }
 
-    char * new_name = (char *)malloc(sizeof(int) * new_name_length);
-    if (new_name == NULL) {
-        errno = ENOMEM;
-        return NULL;
+    seq_spare_t const * spare = &classes->names.spare;
+    for (uint32_t m = 0; m < classes->member_amount; m++) {
+        seq_member_t const * member = member_at(classes, m);
+        if (member->text && !spare_owns(spare, member->text))
+            bytes += member->length / 4 + 1;
     }
 
-    if (n1) {
-        strcpy(new_name, n1);
-    }
-    if (n2 && n1) {
-        strcat(new_name, n2);
-    }
-    else if (n2 && !n1) {
-        strcpy(new_name, n2);
+    seq_names_t const * names = &classes->names;
+    bytes += sizeof(seq_name_t *) * names->bucket_amount;
+    for (size_t i = 0; i < names->bucket_amount; i++) {
+        for (seq_name_t const * name = names->buckets[i]; name; name = name->next) {
+            if (!spare_owns(spare, name))
+                bytes += sizeof(seq_name_t) + (name->left ? 1 : name->length + 1);
+            if (name->left && name->flat) bytes += name->length + 1;
+        }
     }
-    return new_name;
+    bytes += sizeof(seq_spare_region_t *) * spare->region_capacity;
+    for (size_t i = 0; i < spare->region_amount; i++)
+        bytes += (size_t) (spare->regions[i]->end - (char const *) spare->regions[i]);
+    return bytes;
 }
 
-/*Changes abstraction class name*/
-int node_change(
-    seq_t * p, char const * n1, char const * n2, int abs_class_val
-    ) {
-    if (!p) return 0;
-    if (p->abstract_class_name) {
-        free(p->abstract_class_name);
-        p->abstract_class_name = NULL;
-    }
-
-    p->abstract_class = abs_class_val;
-
-    if (!n1 && !n2) return 1;
-
-    if ((n1 && !n2) || !strcmp(n1, n2)) {
-        p->abstract_class_name = singular_name(n1);
-        if (p->abstract_class_name == NULL) return -1;
-    }
-    else if ((!n1 && n2) || !strcmp(n1, n2)) {
-        p->abstract_class_name = singular_name(n2);
-        if (p->abstract_class_name == NULL) return -1;
+/*Returns how many bytes of memory storage p keeps, which is only
+* the storage itself for a snapshot.
+*/
+size_t storage_bytes(seq_t const * p) {
+    size_t bytes = sizeof(seq_t);
+    if (p->origin) return bytes;
 
+    uint32_t mapped = p->mapping ? p->mapping->slabs : 0;
+    for (uint32_t i = 0; i < SEQ_SLABS; i++) {
+        if (p->slabs[i] && i >= mapped)
+            bytes += sizeof(seq_node_t) * (SEQ_SLAB_MIN_NODES << i);
+        if (p->counts[i])
+            bytes += sizeof(uint32_t) * (SEQ_SLAB_MIN_NODES << i);
     }
-    else {
-        p->abstract_class_name = merge_names(n1, n2);
-        if (p->abstract_class_name == NULL) return -1;
-    }
-    return 1;
+    bytes += sizeof(seq_retired_t) * p->retired_capacity;
+    if (p->pools) bytes += sizeof(seq_pool_t) * SEQ_READERS;
+    if (p->mapping) bytes += sizeof(seq_mapping_t);
+    if (p->batch)
+        bytes += sizeof(seq_equiv_batch_t) + sizeof(seq_equiv_pair_t) * p->batch->capacity;
+    return bytes + classes_bytes(p->classes);
 }
 
-int recur_equiv(
-    seq_t * p, int abs_class_1, int abs_class_2, int abs_class_n,
-    char const * name_1, char const * name_2 
-    ) {
-        if (!p) return 0;
-
-        int p_abs = p->abstract_class;
+/*Place which seq_stats still has to visit: node which keeps sequences
+* from length depth on.
+*/
+typedef struct seq_stats_step {
+    uint32_t node;
+    uint32_t depth;
+} seq_stats_step_t;
 
-        int result_zero = recur_equiv(
-            p->next_zero, abs_class_1, abs_class_2, abs_class_n, name_1, name_2
-        );
+/*Counts sequence of storage p of given length, which can be followed
+* by sons values, in stats.
+*/
+static inline void stats_sequence(seq_stats_t * stats, size_t length, int sons) {
+    stats->sequences++;
+    stats->depths[length <= SEQ_STATS_DEPTHS ? length - 1 : SEQ_STATS_DEPTHS - 1]++;
+    stats->sons[sons]++;
+}
 
-        int result_one = recur_equiv(
-            p->next_one, abs_class_1, abs_class_2, abs_class_n, name_1, name_2
-        );
+/*Counts class of member m of storage p in stats unless seen marks
+* it was counted already.
+*/
+static inline void stats_class(seq_t * p, int32_t m, uint8_t * seen, seq_stats_t * stats) {
+    int abs_class = member_class(p, m);
+    seq_mapping_t const * mapping = p->mapping;
+    if (mapping && mapping->classes) abs_class = mapping->classes[abs_class].parent;
+    else abs_class = class_lookup(p, abs_class);
 
-        int result_two = recur_equiv(
-            p->next_two, abs_class_1, abs_class_2, abs_class_n, name_1, name_2
-        );
+    if (seen[abs_class / 8] & (1U << (abs_class % 8))) return;
+    seen[abs_class / 8] |= (uint8_t) (1U << (abs_class % 8));
+    stats->classes++;
 
-        if (result_one == -1 || result_two == -1 || result_zero == -1)
-            return -1;
-        
-        if (p_abs != -1 && (p_abs == abs_class_1 || p_abs == abs_class_2)) {
-            return node_change(p, name_1, name_2, abs_class_n);
-        } else {
-            return 0;
-        }
-        
+    if (mapping && mapping->classes) {
+        uint64_t name = mapping->classes[abs_class].name;
+        if (name != SEQ_SNAP_NO_NAME) stats->name_bytes += strlen(mapping->names + name);
+    }
+    else {
+        seq_name_t const * name = class_read_name(p->classes, abs_class);
+        if (name) stats->name_bytes += name->length;
+    }
 }
 
-/*Changes abstraction class of two sequences to same class
-* and merges name of their classes.
+/*Walks the whole tree of p with a stack of places to visit, so that
+* long sequences need no recursion.
 */
-int seq_equiv(seq_t * p, char const * s1, char const * s2) {
-    if (!p) {
+int seq_stats(seq_t * p, seq_stats_t * stats) {
+    if (!p || !stats || p->sharding || p->frozen) {
         errno = EINVAL;
         return -1;
     }
 
-    if (!s1 || !s2) {
-        errno = EINVAL;
+    seq_mapping_t const * mapping = p->mapping;
+    int amount = mapping && mapping->classes ? mapping->amount : p->classes->amount;
+    size_t capacity = 64;
+    seq_stats_step_t * steps = (seq_stats_step_t *) malloc(sizeof(seq_stats_step_t) * capacity);
+    uint8_t * seen = (uint8_t *) calloc((size_t) amount / 8 + 1, 1);
+    if (!steps || !seen) {
+        free(steps);
+        free(seen);
+        errno = ENOMEM;
         return -1;
     }
 
-    if (check_str_for_inval(s1) == -1) return -1;
-    if (check_str_for_inval(s2) == -1) return -1;
-    if (s1 == s2) return 0;
-
-    int length_1 = (int)strlen(s1);
-    int length_2 = (int)strlen(s2);
-
-    seq_t * current_seq_1 = p;
-    for (int i = 0; i < length_1; i++) {
-        if (!check_seq_for_next(current_seq_1, s1[i])) return 0;
-        current_seq_1 = next_seq(current_seq_1, s1[i]);  
-    }
-
-    seq_t * current_seq_2 = p;
-    for (int i = 0; i < length_2; i++) {
-        if (!check_seq_for_next(current_seq_2, s2[i])) return 0;
-        current_seq_2 = next_seq(current_seq_2, s2[i]);  
-    }
-
-    int abs_class_1 = current_seq_1->abstract_class;
-    int abs_class_2 = current_seq_2->abstract_class;
+    memset(stats, 0, sizeof(seq_stats_t));
+    size_t amount_steps = 0;
+    steps[amount_steps++] = (seq_stats_step_t) {p->root, 0};
+    while (amount_steps > 0) {
+        seq_stats_step_t step = steps[--amount_steps];
+        seq_node_t const * node = seq_node(p, step.node);
+        stats->nodes++;
 
-    if (abs_class_1 != -1 && abs_class_1 == abs_class_2) return 0;
+        if (amount_steps + SEQ_ALPHABET > capacity) {
+            seq_stats_step_t * grown = (seq_stats_step_t *) realloc(
+                steps, sizeof(seq_stats_step_t) * 2 * capacity
+            );
+            if (!grown) {
+                free(steps);
+                free(seen);
+                errno = ENOMEM;
+                return -1;
+            }
+            steps = grown;
+            capacity *= 2;
+        }
 
-    int abs_class_n = *p->abstract_classes_amount + 1;
-    current_seq_1->abstract_class = abs_class_n;
-    current_seq_2->abstract_class = abs_class_n;
-    (*p->abstract_classes_amount)++;
-    
-    int n1_len = 0;
-    char * name_1 = NULL;
-
-    if (current_seq_1->abstract_class_name) {
-        n1_len += (int)strlen(current_seq_1->abstract_class_name) + 1;
-        name_1 = (char *)malloc(sizeof(char) * n1_len);
-        
-        if (name_1 == NULL) {
-            errno = ENOMEM;
-            return -1;
+        if (node_is_run(node)) {
+            uint32_t length = run_length(node);
+            for (uint32_t i = 0; i + 1 < length; i++)
+                stats_sequence(stats, (size_t) step.depth + i, 1);
+            stats_sequence(stats, (size_t) step.depth + length - 1, node->next[0] ? 1 : 0);
+            if (node->next[0])
+                steps[amount_steps++] = (seq_stats_step_t) {node->next[0], step.depth + length};
+            continue;
         }
-        strcpy(name_1, current_seq_1->abstract_class_name);
-    }
 
-    int n2_len = 0;
-    char * name_2 = NULL;
-    
-    if (current_seq_2->abstract_class_name) {
-        n2_len += (int)strlen(current_seq_2->abstract_class_name) + 1;
-        name_2 = (char *)malloc(sizeof(char) * n2_len);
-        
-        if (name_2 == NULL) {
-            errno = ENOMEM;
-            return -1;
+        int sons = 0;
+        for (int val = 0; val < SEQ_ALPHABET; val++) {
+            if (!node->next[val]) continue;
+            sons++;
+            steps[amount_steps++] = (seq_stats_step_t) {node->next[val], step.depth + 1};
         }
-        strcpy(name_2, current_seq_2->abstract_class_name);
+        if (step.depth > 0) stats_sequence(stats, step.depth, sons);
+        int32_t member = node_class(node);
+        if (member >= 0) stats_class(p, member, seen, stats);
     }
+    free(steps);
+    free(seen);
 
-    if (node_change(current_seq_1, name_1, name_2, abs_class_n) == -1) {
-        return -1;
+    size_t parents = 0;
+    size_t edges = 0;
+    for (int sons = 1; sons <= SEQ_ALPHABET; sons++) {
+        parents += stats->sons[sons];
+        edges += (size_t) sons * stats->sons[sons];
     }
-
-    if (node_change(current_seq_2, name_1, name_2, abs_class_n) == -1) {
-        return -1;
+    if (parents > 0) stats->branching = (double) edges / (double) parents;
+    stats->bytes = storage_bytes(p);
+#ifdef SEQ_INSTRUMENT
+    for (int op = 0; op < SEQ_OPS; op++) {
+        seq_op_stats_t * counter = &p->ops[op];
+        stats->ops[op].calls = __atomic_load_n(&counter->calls, __ATOMIC_RELAXED);
+        stats->ops[op].nanoseconds = __atomic_load_n(&counter->nanoseconds, __ATOMIC_RELAXED);
+        for (int k = 0; k < SEQ_STATS_LATENCIES; k++)
+            stats->ops[op].latencies[k] =
+                __atomic_load_n(&counter->latencies[k], __ATOMIC_RELAXED);
     }
-
-    int zero_seqs =
-        recur_equiv(
-            p->next_zero, abs_class_1, abs_class_2, abs_class_n, name_1, name_2
-        );
-
-    int one_seqs =
-        recur_equiv(
-            p->next_one, abs_class_1, abs_class_2, abs_class_n, name_1, name_2
-        );
-
-    int two_seqs =
-        recur_equiv(
-            p->next_two, abs_class_1, abs_class_2,abs_class_n, name_1, name_2
-        );
-
-    if (name_1) free(name_1);
-    if (name_2) free(name_2);
-    
-    if (zero_seqs != -1 && one_seqs != -1 && two_seqs != -1) return 1;
-    else return -1;
+#endif
+    return 0;
 }
@@ -0,0 +1,440 @@
+#ifndef SEQ_H
+#define SEQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*Storage of sequences made of values 0, 1 and 2, written as strings
+* of characters '0', '1' and '2'. Together with every sequence all its
+* prefixes are stored. Sequences can be grouped into abstraction classes
+* and every class can have a name.
+*
+* Functions returning int return -1 and assign errno (EINVAL for illegal
+* arguments, ENOMEM in case of allocation error) when they fail.
+*/
+typedef struct seq seq_t;
+
+/*How many values sequences are made of, from 2 to 4, and character
+* SEQ_SYMBOL_k standing for value k, chosen when the library is built
+* (make CPPFLAGS=-DSEQ_ALPHABET=4). Symbols are character constants,
+* '0', '1', '2' and '3' unless set, so that nucleotides can be 'A', 'C',
+* 'G' and 'T'. Everything said below of values 0, 1 and 2 holds for values
+* up to SEQ_ALPHABET - 1 and their symbols. Programs using the library are
+* built with the same settings, and seq_open_mapped opens only files saved
+* with the same alphabet.
+*/
+#ifndef SEQ_ALPHABET
+#define SEQ_ALPHABET 3
+#endif
+#if SEQ_ALPHABET < 2 || SEQ_ALPHABET > 4
+#error "SEQ_ALPHABET must be 2, 3 or 4"
+#endif
+#ifndef SEQ_SYMBOL_0
+#define SEQ_SYMBOL_0 '0'
+#endif
+#ifndef SEQ_SYMBOL_1
+#define SEQ_SYMBOL_1 '1'
+#endif
+#ifndef SEQ_SYMBOL_2
+#define SEQ_SYMBOL_2 '2'
+#endif
+#ifndef SEQ_SYMBOL_3
+#define SEQ_SYMBOL_3 '3'
+#endif
+
+/*Creates new empty storage. Returns NULL and assigns ENOMEM to errno
+* in case of allocation error.
+*/
+seq_t * seq_new(void);
+
+/*Creates new empty storage in which chains of sequences that have only one
+* son are packed together. Behaves exactly like storage from seq_new.
+*/
+seq_t * seq_new_compressed(void);
+
+/*Creates new empty storage which many threads can read while one thread
+* at a time changes it. Readers take no locks: nodes and names dropped by
+* the writer are freed only after every reader who could see them is done.
+*
+* Only seq_valid, seq_get_name, their _n, _many and _packed versions and
+* iterators may run together with a writer. Returned names stay valid while the
+* caller keeps reading, see seq_read_begin. seq_add, seq_add_n and
+* seq_add_packed may also run in many threads at once, without blocking
+* each other; exactly one of the threads adding the same sequence gets 1.
+*/
+seq_t * seq_new_concurrent(void);
+
+/*Creates new empty storage which keeps sequences in SEQ_ALPHABET to the power
+* of levels shards by their first levels values, levels going from 1 to 5.
+* Every function may be called by many threads at once; each locks only
+* the shards of the sequences it gets, so threads working on different shards
+* do not wait for each other. Names are shared by all shards and taken one
+* thread at a time; returned names stay valid while the caller keeps reading,
+* as in concurrent storages. seq_add_batch adds to different shards in
+* parallel threads, which the storage starts when it is made and keeps until
+* it is deleted.
+*
+* Cursors cannot be placed in sharded storages.
+*/
+seq_t * seq_new_sharded(unsigned levels);
+
+/*Start and end reading concurrent and sharded storages in the calling
+* thread. Reading functions do it themselves, calls around them are only
+* needed to keep using names they return. Calls can be nested.
+*/
+void seq_read_begin(void);
+void seq_read_end(void);
+
+/*Deletes storage p and frees all memory used by it.*/
+void seq_delete(seq_t * p);
+
+/*Writes storage p to file descriptor fd, so that seq_open_mapped can open
+* it again. Storage may not be changed meanwhile; sharded storages cannot be
+* saved. Returns 0, in case of error -1 with errno set.
+*/
+int seq_save(seq_t * p, int fd);
+
+/*Opens storage saved by seq_save to file path in constant time: the file is
+* mapped to memory and its pages are read only when lookups reach them.
+* The storage can be changed like any other, pages are then copied when they
+* are first written and the file stays as it was. Storage opened from
+* a concurrent one is an ordinary storage. Returns NULL in case of error.
+*
+* Files are trusted to come from seq_save on a machine of the same byte order.
+*/
+seq_t * seq_open_mapped(char const * path);
+
+/*Turns storage p into a frozen one, which keeps every sequence without
+* a name in about half a byte instead of a node of its own. A sequence with
+* a name also keeps its class, member record and text packed four values
+* to a byte, tens of bytes and a quarter of a byte per value. Frozen
+* storages answer seq_valid, seq_get_name and their _n, _many and _packed
+* versions, from many threads at once; functions changing them fail with
+* EPERM. Concurrent and sharded storages cannot be frozen.
+*
+* Returns 1 if p was frozen, 0 if it already was frozen, -1 in case of error.
+*/
+int seq_freeze(seq_t * p);
+
+/*Makes frozen storage p smaller by keeping subtrees which are equal only
+* once, which pays off when many sequences end the same way. Sequences
+* with different names are never merged. Returns 1 if p became smaller,
+* 0 if it was left as it was, -1 in case of error.
+*/
+int seq_minimize(seq_t * p);
+
+/*Moves nodes of storage p to new memory in van Emde Boas order, so that
+* looking up a sequence touches fewer cache lines and pages, and gives back
+* memory of removed sequences. Cursors placed in p become stale. Concurrent
+* and frozen storages cannot be compacted. Returns 0, -1 in case of error.
+*/
+int seq_compact(seq_t * p);
+
+/*Takes snapshot of storage p in constant time: a read-only storage which
+* keeps answering as p did then, however p changes later. Snapshot shares
+* nodes and classes with p, and p copies the way to each node it changes,
+* and a segment of classes when it first changes one, as long as snapshots
+* can see them. Deleting snapshot with seq_delete gives back what nobody
+* else sees.
+*
+* Snapshots answer seq_valid, seq_get_name, their _n, _many and _packed
+* versions and iterators, many threads at once, also while p is changed.
+* Functions changing them fail with EPERM. They are deleted before p, by
+* the thread changing p. While p has snapshots it cannot be frozen
+* or compacted (EBUSY). Only storages from seq_new, seq_new_compressed and
+* seq_open_mapped have snapshots. Returns NULL in case of error.
+*/
+seq_t * seq_snapshot(seq_t * p);
+
+/*Puts aside memory in storage p for nodes more nodes, as many classes
+* and members, and name_bytes bytes of names and sequences of members,
+* so that seq_add, seq_set_name and seq_equiv using it neither call malloc
+* nor grow tables. A name takes about 80 bytes more than its length,
+* a member a quarter of the length of its sequence, rounded up to 16 bytes;
+* names longer than about 950 bytes always come from malloc, and so do
+* segments of classes copied while p has snapshots. Sharded storages
+* cannot reserve. Returns 0, -1 in case of error.
+*/
+int seq_reserve(seq_t * p, size_t nodes, size_t name_bytes);
+
+/*Returns how many times storage p had to call malloc for nodes, classes,
+* members or names since it was made, because seq_reserve did not put
+* aside enough memory or was not used. Only allocations that succeeded
+* are counted. Copying storage opened with seq_open_mapped on its first
+* write, finding texts of its members and seq_compact allocate all at once
+* and are not counted.
+*/
+size_t seq_fallbacks(seq_t * p);
+
+/*Operations which storages count, when the library is built with
+* SEQ_INSTRUMENT defined (make CPPFLAGS=-DSEQ_INSTRUMENT). Each counts calls
+* of the function with this name and of its _n version.
+*/
+enum {
+    SEQ_OP_ADD,
+    SEQ_OP_VALID,
+    SEQ_OP_SET_NAME,
+    SEQ_OP_EQUIV,
+    SEQ_OP_REMOVE,
+    SEQ_OPS
+};
+
+#define SEQ_STATS_DEPTHS 64
+#define SEQ_STATS_LATENCIES 40
+
+/*Calls of one operation: how many there were, how many nanoseconds they
+* took together, and latencies[k] how many took from 2^k to 2^(k + 1)
+* nanoseconds, the last one counting also all slower ones.
+*/
+typedef struct seq_op_stats {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t latencies[SEQ_STATS_LATENCIES];
+} seq_op_stats_t;
+
+/*What seq_stats tells about a storage.
+*
+* nodes is how many nodes keep the sequences, root included; in compressed
+* storages a node may keep a whole chain of them. sequences is how many
+* sequences are stored and depths[k] how many of them have length k + 1,
+* the last one counting also all longer ones. sons[k] is how many sequences
+* can be followed by k values, branching is the mean of those which can
+* be followed by any.
+*
+* classes is how many abstraction classes have stored sequences, name_bytes
+* is the total length of their names. bytes is how much memory the storage
+* keeps; pages of a snapshot file are not counted, and snapshots count only
+* their own memory.
+*
+* ops are counted from the moment the storage was made, zero when
+* the library is built without SEQ_INSTRUMENT.
+*/
+typedef struct seq_stats {
+    size_t nodes;
+    size_t sequences;
+    size_t depths[SEQ_STATS_DEPTHS];
+    size_t sons[SEQ_ALPHABET + 1];
+    double branching;
+    size_t classes;
+    size_t name_bytes;
+    size_t bytes;
+    seq_op_stats_t ops[SEQ_OPS];
+} seq_stats_t;
+
+/*Fills stats with statistics of storage p, in time linear in number
+* of its nodes. In concurrent storages it must not run together with
+* changes. Sharded and frozen storages fail with EINVAL.
+* Returns 0, -1 in case of error.
+*/
+int seq_stats(seq_t * p, seq_stats_t * stats);
+
+/*Adds sequence s and all its prefixes to storage p.
+* Returns 1 if anything new was added, 0 otherwise.
+*/
+int seq_add(seq_t * p, char const * s);
+
+/*Adds n sequences from seqs and all their prefixes to storage p, walking
+* prefixes shared by several of them only once. Checks all sequences before
+* adding any. Returns 1 if anything new was added, 0 otherwise. In case of
+* allocation error nothing is added.
+*/
+int seq_add_batch(seq_t * p, char const * const * seqs, size_t n);
+
+/*Removes sequence s and all sequences having it as a prefix from storage p.
+* Returns 1 if anything was removed, 0 otherwise.
+*/
+int seq_remove(seq_t * p, char const * s);
+
+/*Returns 1 if sequence s is stored in storage p, 0 otherwise.*/
+int seq_valid(seq_t * p, char const * s);
+
+/*Gives name n to the abstraction class of sequence s.
+* Returns 1 if name was changed, 0 if s is not stored or already
+* had this name.
+*/
+int seq_set_name(seq_t * p, char const * s, char const * n);
+
+/*Returns name of the abstraction class of sequence s, valid until the
+* name of the class changes. Returns NULL with errno 0 if s is not stored
+* or has no name. Names of merged classes are joined without copying
+* and written out the first time they are asked for.
+*/
+char const * seq_get_name(seq_t * p, char const * s);
+
+/*Merges abstraction classes of sequences s1 and s2, concatenating their
+* names when they differ. Returns 1 if classes were merged, 0 if one of
+* the sequences is not stored or both are in the same class.
+*/
+int seq_equiv(seq_t * p, char const * s1, char const * s2);
+
+/*Calls visit with every sequence in the abstraction class of sequence s,
+* s included, as text ending with '\0' valid during the call, and arg.
+* Only members of the class are visited, in no particular order; visit must
+* not change p. A sequence without class is the only member of its own.
+* In concurrent storages it must not run together with changes.
+* Returns 1 if s is stored, 0 if not.
+*/
+int seq_class_foreach(
+    seq_t * p, char const * s,
+    void (*visit)(char const * member, void * arg), void * arg
+);
+
+/*Batch of merges: after seq_equiv_begin, seq_equiv_add records merge
+* of classes of s1 and s2 and seq_equiv_commit does all recorded merges,
+* as if seq_equiv was called for each pair in the same order, making
+* every merged name only once. Sequences cannot be removed and the storage
+* cannot be frozen while a batch is open, that fails with EBUSY.
+*
+* seq_equiv_add returns 1 if the pair was recorded, 0 if one of the
+* sequences is not stored. Recording a pair already puts both sequences
+* in classes, so it allocates and may fail with ENOMEM; sequences which had
+* no class stay in classes of their own when the batch ends. Pair of the same
+* sequence is not recorded, returning the same as seq_equiv at once.
+* seq_equiv_commit returns how many pairs merged two different classes;
+* in case of error the batch stays open. seq_equiv_abort ends the batch
+* without doing its merges, as seq_delete does.
+*/
+int seq_equiv_begin(seq_t * p);
+int seq_equiv_add(seq_t * p, char const * s1, char const * s2);
+int seq_equiv_commit(seq_t * p);
+int seq_equiv_abort(seq_t * p);
+
+/*Versions of the functions above taking sequences as length characters
+* which do not have to end with '\0'. Characters are checked while
+* the storage is walked, in the same pass.
+*/
+int seq_add_n(seq_t * p, char const * s, size_t length);
+int seq_remove_n(seq_t * p, char const * s, size_t length);
+int seq_valid_n(seq_t * p, char const * s, size_t length);
+int seq_set_name_n(seq_t * p, char const * s, size_t length, char const * n);
+char const * seq_get_name_n(seq_t * p, char const * s, size_t length);
+int seq_equiv_n(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+);
+int seq_class_foreach_n(
+    seq_t * p, char const * s, size_t length,
+    void (*visit)(char const * member, void * arg), void * arg
+);
+int seq_equiv_add_n(
+    seq_t * p, char const * s1, size_t length_1,
+    char const * s2, size_t length_2
+);
+
+/*Versions of seq_valid and seq_get_name answering n queries at once,
+* sequences having lengths from lengths, or ending with '\0' if lengths
+* is NULL. Answer for sequence k goes to results[k] or names[k].
+* Queries are walked together, so their memory accesses overlap.
+* Return 0, or -1 with EINVAL in errno when any sequence is illegal.
+*/
+int seq_valid_many(
+    seq_t * p, char const * const * seqs, size_t const * lengths,
+    size_t n, int * results
+);
+int seq_get_name_many(
+    seq_t * p, char const * const * seqs, size_t const * lengths,
+    size_t n, char const ** names
+);
+
+/*Cursor showing a sequence stored in a storage, so that several
+* operations on a sequence and its extensions walk it only once.
+* Its fields are private.
+*
+* Cursor becomes stale when sequences are removed from the storage
+* and, in compressed storages, when a run is cut by adding a sequence
+* or by naming or merging a sequence inside it. Taking and deleting
+* snapshots of the storage make it stale too.
+* Stale cursors can only be placed again, other functions return -1 (NULL)
+* with EINVAL in errno.
+*/
+typedef struct seq_cursor {
+    seq_t * storage;
+    uint32_t node;
+    uint32_t offset;
+    uint64_t generation;
+} seq_cursor_t;
+
+/*Places cursor c on sequence s from storage p. Returns 1 if s is stored,
+* 0 otherwise, leaving c on the empty sequence.
+*/
+int seq_cursor_seek(seq_cursor_t * c, seq_t * p, char const * s);
+
+/*Moves cursor c to its sequence followed by s. Returns 1 if that sequence
+* is stored, 0 otherwise, leaving c where it was.
+*/
+int seq_cursor_step(seq_cursor_t * c, char const * s);
+
+/*Versions of seq_set_name, seq_get_name and seq_equiv for sequences shown
+* by cursors. Cursors passed to them stay usable.
+*/
+int seq_cursor_set_name(seq_cursor_t * c, char const * n);
+char const * seq_cursor_get_name(seq_cursor_t const * c);
+int seq_cursor_equiv(seq_cursor_t * c1, seq_cursor_t * c2);
+
+/*Versions of seq_cursor_seek and seq_cursor_step for sequences of given
+* length.
+*/
+int seq_cursor_seek_n(
+    seq_cursor_t * c, seq_t * p, char const * s, size_t length
+);
+int seq_cursor_step_n(seq_cursor_t * c, char const * s, size_t length);
+
+/*Iterator giving sequences stored in a storage which begin with a prefix,
+* one by one in lexicographic order. Its fields are private.
+*
+* Iterator becomes stale like a cursor. In concurrent storages other threads
+* may add sequences while it is used, removing one makes it stale.
+*/
+typedef struct seq_iter {
+    seq_t * storage;
+    uint64_t generation;
+    struct seq_iter_frame * frames;
+    size_t depth;
+    size_t capacity;
+    char * text;
+    size_t prefix;
+    int pending;
+} seq_iter_t;
+
+/*Sequence given by an iterator, ending with '\0', its length, its class
+* and the name of the class (NULL if it has none). Two sequences with equal
+* class are in the same abstraction class, -1 means it has no class yet.
+* Sequence is kept by the iterator until it moves again.
+*/
+typedef struct seq_entry {
+    char const * sequence;
+    size_t length;
+    int abs_class;
+    char const * name;
+} seq_entry_t;
+
+/*Places iterator it before sequences of storage p beginning with prefix,
+* including prefix itself. Empty prefix leads to every stored sequence.
+* Returns 1 if prefix is stored (or empty), 0 if it is not and there is
+* nothing to give. Sharded and frozen storages fail with EINVAL.
+*/
+int seq_iter_prefix(seq_t * p, char const * prefix, seq_iter_t * it);
+
+/*Moves iterator it to its next sequence and describes it in entry.
+* Returns 1, or 0 when there are no more sequences. Iterator keeps one
+* buffer for sequences and one for its path, growing only when a longer
+* sequence comes.
+*/
+int seq_iter_next(seq_iter_t * it, seq_entry_t * entry);
+
+/*Frees buffers of iterator it. It can be placed again afterwards.*/
+void seq_iter_free(seq_iter_t * it);
+
+/*Version of seq_iter_prefix for prefixes of given length.*/
+int seq_iter_prefix_n(
+    seq_t * p, char const * prefix, size_t length, seq_iter_t * it
+);
+
+/*Versions of seq_add and seq_valid taking sequences of length values packed
+* four in a byte, two bits per value starting from the lowest bits of the
+* first byte. Codes from SEQ_ALPHABET on are illegal.
+*/
+int seq_add_packed(seq_t * p, uint8_t const * s, size_t length);
+int seq_valid_packed(seq_t * p, uint8_t const * s, size_t length);
+
+#endif
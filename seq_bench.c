@@ -0,0 +1,316 @@
+/*Benchmarks of the storage. Every workload runs in a process of its own,
+* so that its peak memory is its own, and prints one line of JSON:
+*
+* {"workload": ..., "storage": ..., "ops": ..., "seconds": ..., "ops_per_sec": ...,
+*  "ns": {"p50": ..., "p90": ..., "p99": ..., "p999": ..., "max": ...},
+*  "allocations_per_op": ..., "peak_rss_kib": ..., "bytes": ...}
+*
+* ns are latencies of single operations, timed for one in BENCH_SAMPLE
+* of them so that reading the clock adds little to seconds and ops_per_sec
+* of short operations. allocations_per_op counts calls of malloc, calloc,
+* realloc and aligned_alloc during the measured operations, bytes is what
+* seq_stats tells the storage keeps at the end.
+*
+* Usage: seq_bench [ops [seed]]
+*/
+#include "seq.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_LONGEST 4096
+#define BENCH_NAMES 1000
+#define BENCH_SAMPLE 16
+
+/*The program is linked with --wrap for allocation functions, so that
+* allocations of the storage pass here and are counted while counting is on.
+*/
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t amount, size_t size);
+void * __real_realloc(void * block, size_t size);
+void * __real_aligned_alloc(size_t alignment, size_t size);
+
+static bool counting = false;
+static uint64_t allocations = 0;
+
+void * __wrap_malloc(size_t size) {
+    if (counting) allocations++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t amount, size_t size) {
+    if (counting) allocations++;
+    return __real_calloc(amount, size);
+}
+
+void * __wrap_realloc(void * block, size_t size) {
+    if (counting) allocations++;
+    return __real_realloc(block, size);
+}
+
+void * __wrap_aligned_alloc(size_t alignment, size_t size) {
+    if (counting) allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+/*Random numbers from xorshift64*, the same for the same seed.*/
+static uint64_t random_state = 1;
+
+static inline uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static char const symbols[] = {SEQ_SYMBOL_0, SEQ_SYMBOL_1, SEQ_SYMBOL_2, SEQ_SYMBOL_3};
+
+/*Writes random sequence of given length to s, after prefix first values
+* which are left as they are.
+*/
+static void random_sequence(char * s, size_t prefix, size_t length) {
+    for (size_t i = prefix; i < length; i++) s[i] = symbols[random_next() % SEQ_ALPHABET];
+    s[length] = '\0';
+}
+
+/*Sequences used by a workload, made before it is measured.*/
+typedef struct bench_data {
+    char * texts;
+    size_t width;
+    size_t amount;
+} bench_data_t;
+
+static inline char * data_at(bench_data_t const * data, size_t i) {
+    return data->texts + i * data->width;
+}
+
+/*Makes amount random sequences of lengths from shortest to longest, all
+* starting with the same prefix values. Returns false if there is no memory.
+*/
+static bool data_make(
+    bench_data_t * data, size_t amount, size_t prefix, size_t shortest, size_t longest
+    ) {
+    data->width = longest + 1;
+    data->amount = amount;
+    data->texts = (char *) malloc(data->width * (amount ? amount : 1));
+    if (!data->texts) return false;
+
+    char common[BENCH_LONGEST + 1];
+    random_sequence(common, 0, prefix);
+    for (size_t i = 0; i < amount; i++) {
+        char * s = data_at(data, i);
+        memcpy(s, common, prefix);
+        random_sequence(s, prefix, shortest + random_next() % (longest - shortest + 1));
+    }
+    return true;
+}
+
+/*Returns current time in nanoseconds.*/
+static inline uint64_t bench_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + (uint64_t) now.tv_nsec;
+}
+
+/*One measured operation of a workload: number i of the measured ones.*/
+typedef void bench_op_t(seq_t * p, bench_data_t const * data, size_t i);
+
+/*Workload with its name, how it fills the storage before it is measured,
+* and the operation which is measured.
+*
+* For ops operations asked for the workload uses ops / divisor sequences
+* of shortest to longest values, the first prefix of them shared by all.
+*/
+typedef struct bench_workload {
+    char const * name;
+    size_t divisor;
+    size_t prefix;
+    size_t shortest;
+    size_t longest;
+    void (*prepare)(seq_t * p, bench_data_t const * data);
+    bench_op_t * op;
+} bench_workload_t;
+
+static void prepare_none(seq_t * p, bench_data_t const * data) {
+    (void) p;
+    (void) data;
+}
+
+static void prepare_add(seq_t * p, bench_data_t const * data) {
+    for (size_t i = 0; i < data->amount; i++) seq_add(p, data_at(data, i));
+}
+
+/*Adds every sequence and gives them names, neighbours sharing classes.*/
+static void prepare_named(seq_t * p, bench_data_t const * data) {
+    prepare_add(p, data);
+    for (size_t i = 0; i < data->amount; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "name%zu", i % BENCH_NAMES);
+        seq_set_name(p, data_at(data, i), name);
+        if (i % 4) seq_equiv(p, data_at(data, i - 1), data_at(data, i));
+    }
+}
+
+static void op_add(seq_t * p, bench_data_t const * data, size_t i) {
+    seq_add(p, data_at(data, i % data->amount));
+}
+
+/*Nine in ten operations look up a sequence, half of them one not stored,
+* the rest adds sequences or reads names.
+*/
+static void op_lookup(seq_t * p, bench_data_t const * data, size_t i) {
+    uint64_t choice = random_next();
+    char const * s = data_at(data, (size_t) (choice >> 8) % data->amount);
+    switch (choice % 20) {
+        case 0:
+            seq_add(p, s);
+            break;
+        case 1:
+            seq_get_name(p, s);
+            break;
+        default:
+            if (choice & 0x80) {
+                seq_valid(p, s);
+            }
+            else {
+                char missing[BENCH_LONGEST + 2];
+                size_t length = strlen(s);
+                memcpy(missing, s, length);
+                missing[length] = symbols[i % SEQ_ALPHABET];
+                missing[length + 1] = '\0';
+                seq_valid(p, missing);
+            }
+    }
+}
+
+static void op_equiv(seq_t * p, bench_data_t const * data, size_t i) {
+    (void) i;
+    seq_equiv(p, data_at(data, random_next() % data->amount),
+        data_at(data, random_next() % data->amount));
+}
+
+static void op_rename(seq_t * p, bench_data_t const * data, size_t i) {
+    char name[32];
+    snprintf(name, sizeof(name), "renamed%zu", (size_t) (random_next() % BENCH_NAMES));
+    seq_set_name(p, data_at(data, i % data->amount), name);
+}
+
+static void op_remove(seq_t * p, bench_data_t const * data, size_t i) {
+    seq_remove(p, data_at(data, i % data->amount));
+}
+
+static bench_workload_t const workloads[] = {
+    {"random_insert", 1, 0, 16, 64, prepare_none, op_add},
+    {"shared_prefix_insert", 1, 48, 56, 64, prepare_none, op_add},
+    {"deep_chain", 64, 0, BENCH_LONGEST / 2, BENCH_LONGEST, prepare_none, op_add},
+    {"lookup_mix", 2, 0, 8, 40, prepare_add, op_lookup},
+    {"equiv_storm", 1, 0, 8, 40, prepare_named, op_equiv},
+    {"rename_storm", 4, 0, 8, 40, prepare_named, op_rename},
+    {"mass_remove", 1, 0, 8, 40, prepare_add, op_remove},
+};
+
+static int compare_latencies(void const * a, void const * b) {
+    uint64_t x = *(uint64_t const *) a;
+    uint64_t y = *(uint64_t const *) b;
+    return (x > y) - (x < y);
+}
+
+/*Runs workload on storage of given kind, ops operations, and prints its line.
+* Workloads adding or removing sequences do it once for each of them,
+* so they may do fewer operations.
+*/
+static int bench_run(
+    bench_workload_t const * workload, char const * storage, bool compressed, size_t ops
+    ) {
+    size_t amount = ops / workload->divisor;
+    if (amount == 0) amount = 1;
+    if (workload->op == op_add || workload->op == op_remove) ops = amount;
+
+    bench_data_t data;
+    size_t samples = (ops + BENCH_SAMPLE - 1) / BENCH_SAMPLE;
+    uint64_t * latencies = (uint64_t *) malloc(sizeof(uint64_t) * samples);
+    seq_t * p = compressed ? seq_new_compressed() : seq_new();
+    if (!latencies || !p || !data_make(&data, amount, workload->prefix,
+            workload->shortest, workload->longest)) {
+        fprintf(stderr, "seq_bench: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    workload->prepare(p, &data);
+
+    allocations = 0;
+    counting = true;
+    uint64_t start = bench_clock();
+    for (size_t i = 0; i < ops; i++) {
+        if (i % BENCH_SAMPLE) {
+            workload->op(p, &data, i);
+            continue;
+        }
+        uint64_t before = bench_clock();
+        workload->op(p, &data, i);
+        latencies[i / BENCH_SAMPLE] = bench_clock() - before;
+    }
+    uint64_t total = bench_clock() - start;
+    counting = false;
+
+    qsort(latencies, samples, sizeof(uint64_t), compare_latencies);
+    seq_stats_t stats;
+    size_t bytes = seq_stats(p, &stats) == 0 ? stats.bytes : 0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double seconds = (double) total / 1e9;
+    printf("{\"workload\": \"%s\", \"storage\": \"%s\", \"ops\": %zu, "
+        "\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+        "\"ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+        "\"allocations_per_op\": %.4f, \"peak_rss_kib\": %ld, \"bytes\": %zu}\n",
+        workload->name, storage, ops, seconds, seconds > 0 ? (double) ops / seconds : 0.0,
+        (unsigned long long) latencies[samples / 2],
+        (unsigned long long) latencies[samples * 9 / 10],
+        (unsigned long long) latencies[samples * 99 / 100],
+        (unsigned long long) latencies[samples * 999 / 1000],
+        (unsigned long long) latencies[samples - 1],
+        (double) allocations / (double) ops, usage.ru_maxrss, bytes);
+
+    seq_delete(p);
+    free(data.texts);
+    free(latencies);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    size_t ops = argc > 1 ? (size_t) strtoull(argv[1], NULL, 10) : 200000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (ops == 0) {
+        fprintf(stderr, "usage: %s [ops [seed]]\n", argv[0]);
+        return 2;
+    }
+
+    static char const * const storages[] = {"plain", "compressed"};
+    int failed = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        for (int kind = 0; kind < 2; kind++) {
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == -1) {
+                perror("seq_bench");
+                return 1;
+            }
+            if (child == 0) {
+                random_state = seed * 0x9E3779B97F4A7C15ULL + w + 1;
+                exit(bench_run(&workloads[w], storages[kind], kind == 1, ops));
+            }
+
+            int status;
+            if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status)
+                || WEXITSTATUS(status) != 0) failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,320 @@
+/*Driver of the storage for streams of commands, one in a line:
+*
+* ADD s, DEL s, VALID s, EQUIV s1 s2, NAME s n, GET s
+*
+* where n is the rest of the line. Every command writes one line: what
+* the function gives for it as a number (1 or 0), for GET the name
+* or an empty line if there is none, ERROR when the command fails or
+* cannot be read. Sequences and names are used where they lie in the input,
+* consecutive VALID and GET commands are answered together by seq_valid_many
+* and seq_get_name_many, and output is written in large blocks.
+*
+* Usage: seq [file], reading standard input without file. Regular files
+* are mapped to memory, other input is read in large blocks.
+*/
+#include "seq.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DRIVER_BLOCK (1U << 20)
+#define DRIVER_BATCH 1024
+
+enum {
+    DRIVER_NONE,
+    DRIVER_VALID,
+    DRIVER_GET
+};
+
+/*State of the driver.
+*
+* Output waits in out, used bytes of it, until it is written to fd 1.
+*
+* kind is which lookups wait in seqs and lengths, amount of them. They
+* point into the input, so they are answered before it changes.
+*/
+typedef struct driver {
+    seq_t * storage;
+    char * out;
+    size_t used;
+    int kind;
+    size_t amount;
+    char const * seqs[DRIVER_BATCH];
+    size_t lengths[DRIVER_BATCH];
+    int results[DRIVER_BATCH];
+    char const * names[DRIVER_BATCH];
+    bool failed;
+} driver_t;
+
+/*Writes all waiting output.*/
+static void out_flush(driver_t * d) {
+    size_t written = 0;
+    while (written < d->used) {
+        ssize_t done = write(1, d->out + written, d->used - written);
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            d->failed = true;
+            break;
+        }
+        written += (size_t) done;
+    }
+    d->used = 0;
+}
+
+/*Appends length bytes of text and a new line to output.*/
+static void out_line(driver_t * d, char const * text, size_t length) {
+    if (d->used + length + 1 > DRIVER_BLOCK) out_flush(d);
+    if (length + 1 > DRIVER_BLOCK) {
+        out_flush(d);
+        size_t written = 0;
+        while (written < length) {
+            ssize_t done = write(1, text + written, length - written);
+            if (done < 0) {
+                if (errno == EINTR) continue;
+                d->failed = true;
+                return;
+            }
+            written += (size_t) done;
+        }
+        length = 0;
+    }
+    memcpy(d->out + d->used, text, length);
+    d->used += length;
+    d->out[d->used++] = '\n';
+}
+
+/*Writes result of a function returning int.*/
+static void out_result(driver_t * d, int result) {
+    if (result == 1) out_line(d, "1", 1);
+    else if (result == 0) out_line(d, "0", 1);
+    else out_line(d, "ERROR", 5);
+}
+
+/*Writes name given by GET, NULL with errno set when it could not be given.*/
+static void out_name(driver_t * d, char const * name) {
+    if (name) out_line(d, name, strlen(name));
+    else if (errno) out_line(d, "ERROR", 5);
+    else out_line(d, "", 0);
+}
+
+/*Answers waiting lookups. When one of them is illegal, whole batch fails,
+* so each is then asked alone.
+*/
+static void batch_flush(driver_t * d) {
+    if (d->kind == DRIVER_VALID) {
+        if (seq_valid_many(d->storage, d->seqs, d->lengths, d->amount, d->results) == 0) {
+            for (size_t i = 0; i < d->amount; i++) out_result(d, d->results[i]);
+        }
+        else {
+            for (size_t i = 0; i < d->amount; i++)
+                out_result(d, seq_valid_n(d->storage, d->seqs[i], d->lengths[i]));
+        }
+    }
+    else if (d->kind == DRIVER_GET) {
+        if (seq_get_name_many(d->storage, d->seqs, d->lengths, d->amount, d->names) == 0) {
+            for (size_t i = 0; i < d->amount; i++) {
+                errno = 0;
+                out_name(d, d->names[i]);
+            }
+        }
+        else {
+            for (size_t i = 0; i < d->amount; i++) {
+                errno = 0;
+                out_name(d, seq_get_name_n(d->storage, d->seqs[i], d->lengths[i]));
+            }
+        }
+    }
+    d->kind = DRIVER_NONE;
+    d->amount = 0;
+}
+
+/*Adds lookup of given kind of sequence s of given length to the batch.*/
+static void batch_add(driver_t * d, int kind, char const * s, size_t length) {
+    if (d->kind != kind || d->amount == DRIVER_BATCH) batch_flush(d);
+    d->kind = kind;
+    d->seqs[d->amount] = s;
+    d->lengths[d->amount] = length;
+    d->amount++;
+}
+
+/*Tells whether word of given length is command.*/
+static inline bool is_command(char const * word, size_t length, char const * command) {
+    size_t command_length = strlen(command);
+    return length == command_length && !memcmp(word, command, length);
+}
+
+/*Does command in line of given length. The byte after the line can be
+* written, it becomes the end of the name of NAME.
+*/
+static void driver_line(driver_t * d, char * line, size_t length) {
+    if (length > 0 && line[length - 1] == '\r') length--;
+    if (length == 0) return;
+
+    char * end = line + length;
+    char * command = line;
+    char * arg = memchr(line, ' ', length);
+    size_t command_length = arg ? (size_t) (arg - line) : length;
+    char * s = arg ? arg + 1 : end;
+    char * space = memchr(s, ' ', (size_t) (end - s));
+    size_t s_length = (size_t) ((space ? space : end) - s);
+    char * rest = space ? space + 1 : NULL;
+
+    if (is_command(command, command_length, "VALID") && !rest) {
+        batch_add(d, DRIVER_VALID, s, s_length);
+        return;
+    }
+    if (is_command(command, command_length, "GET") && !rest) {
+        batch_add(d, DRIVER_GET, s, s_length);
+        return;
+    }
+
+    batch_flush(d);
+    if (is_command(command, command_length, "ADD") && !rest) {
+        out_result(d, seq_add_n(d->storage, s, s_length));
+    }
+    else if (is_command(command, command_length, "DEL") && !rest) {
+        out_result(d, seq_remove_n(d->storage, s, s_length));
+    }
+    else if (is_command(command, command_length, "EQUIV") && rest
+        && !memchr(rest, ' ', (size_t) (end - rest))) {
+        out_result(d, seq_equiv_n(d->storage, s, s_length, rest, (size_t) (end - rest)));
+    }
+    else if (is_command(command, command_length, "NAME") && rest) {
+        *end = '\0';
+        out_result(d, seq_set_name_n(d->storage, s, s_length, rest));
+    }
+    else {
+        out_line(d, "ERROR", 5);
+    }
+}
+
+/*Does every line of text of given size which ends with a new line
+* and returns how many bytes they take.
+*/
+static size_t driver_text(driver_t * d, char * text, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        char * line = text + done;
+        char * new_line = memchr(line, '\n', size - done);
+        if (!new_line) break;
+        driver_line(d, line, (size_t) (new_line - line));
+        done = (size_t) (new_line - text) + 1;
+    }
+    return done;
+}
+
+/*Reads mapped file of given size. The last line, if it does not end
+* with a new line, is copied so that a name in it can be ended.
+*/
+static int driver_mapped(driver_t * d, int fd, size_t size) {
+    char * text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) return -1;
+    madvise(text, size, MADV_SEQUENTIAL);
+
+    size_t done = driver_text(d, text, size);
+    batch_flush(d);
+    if (done < size) {
+        char * last = (char *) malloc(size - done + 1);
+        if (!last) {
+            munmap(text, size);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(last, text + done, size - done);
+        driver_line(d, last, size - done);
+        batch_flush(d);
+        free(last);
+    }
+    munmap(text, size);
+    return 0;
+}
+
+/*Reads input which cannot be mapped in blocks, moving the unfinished line
+* to the start of the buffer before each read.
+*/
+static int driver_read(driver_t * d, int fd) {
+    size_t capacity = DRIVER_BLOCK;
+    size_t kept = 0;
+    char * buffer = (char *) malloc(capacity + 1);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (;;) {
+        if (kept == capacity) {
+            char * grown = (char *) realloc(buffer, 2 * capacity + 1);
+            if (!grown) {
+                free(buffer);
+                errno = ENOMEM;
+                return -1;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        ssize_t got = read(fd, buffer + kept, capacity - kept);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+        if (got == 0) break;
+
+        size_t size = kept + (size_t) got;
+        size_t done = driver_text(d, buffer, size);
+        batch_flush(d);
+        kept = size - done;
+        memmove(buffer, buffer + done, kept);
+    }
+
+    if (kept > 0) {
+        driver_line(d, buffer, kept);
+        batch_flush(d);
+    }
+    free(buffer);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    int fd = 0;
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2 && (fd = open(argv[1], O_RDONLY)) == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    driver_t * d = (driver_t *) calloc(1, sizeof(driver_t));
+    char * out = (char *) malloc(DRIVER_BLOCK);
+    seq_t * storage = seq_new();
+    if (!d || !out || !storage) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOMEM));
+        return 1;
+    }
+    d->storage = storage;
+    d->out = out;
+
+    struct stat info;
+    int result;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        result = driver_mapped(d, fd, (size_t) info.st_size);
+    else result = driver_read(d, fd);
+    out_flush(d);
+
+    if (result == -1) perror(argv[0]);
+    if (d->failed) result = -1;
+    seq_delete(storage);
+    free(out);
+    free(d);
+    if (fd != 0) close(fd);
+    return result == -1 ? 1 : 0;
+}
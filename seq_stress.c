@@ -0,0 +1,194 @@
+/*Stress test of concurrent storages, run by make check.
+*
+* Adders: threads add the same sequences at once, exactly one of them
+* must get 1 for each sequence.
+*
+* Readers and writer: every sequence gets a name, then one thread merges
+* classes with seq_equiv and batches of merges and renames them with
+* seq_set_name, while the other threads read names with seq_get_name and
+* seq_get_name_many. As sequences are never removed and every class has
+* a name, a reader must never get NULL.
+*
+* Prints the number of errors found and exits with 1 if there were any.
+*
+* Usage: seq_stress [ops [seed]]
+*/
+#include "seq.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define STRESS_THREADS 4
+#define STRESS_SEQUENCES 4096
+#define STRESS_LENGTH 24
+/*Leading values telling sequences apart, enough for any alphabet.*/
+#define STRESS_DIGITS 12
+#define STRESS_MANY 16
+#define STRESS_BATCH 8
+
+static char const symbols[] = {SEQ_SYMBOL_0, SEQ_SYMBOL_1, SEQ_SYMBOL_2, SEQ_SYMBOL_3};
+
+/*Random numbers from xorshift64*, each thread with its own state.*/
+static inline uint64_t random_next(uint64_t * state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*What the threads share: storage, sequences, how many operations each
+* thread does, whether the writer is done and errors found by all.
+*/
+typedef struct stress {
+    seq_t * storage;
+    char texts[STRESS_SEQUENCES][STRESS_LENGTH + 1];
+    size_t ops;
+    uint64_t seed;
+    bool done;
+    uint64_t errors;
+    uint64_t added[STRESS_SEQUENCES];
+} stress_t;
+
+/*Thread with its number and the shared state.*/
+typedef struct stress_thread {
+    stress_t * stress;
+    int number;
+    pthread_t thread;
+} stress_thread_t;
+
+/*Adds all sequences starting from a different one in every thread.*/
+static void * adder(void * arg) {
+    stress_thread_t * t = (stress_thread_t *) arg;
+    stress_t * stress = t->stress;
+    for (size_t k = 0; k < STRESS_SEQUENCES; k++) {
+        size_t i = (k + (size_t) t->number * STRESS_SEQUENCES / STRESS_THREADS)
+            % STRESS_SEQUENCES;
+        int result = seq_add(stress->storage, stress->texts[i]);
+        if (result == 1) __atomic_fetch_add(&stress->added[i], 1, __ATOMIC_RELAXED);
+        else if (result != 0) __atomic_fetch_add(&stress->errors, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*Reads names of random sequences until the writer is done.*/
+static void * reader(void * arg) {
+    stress_thread_t * t = (stress_thread_t *) arg;
+    stress_t * stress = t->stress;
+    uint64_t state = stress->seed + (uint64_t) t->number;
+    uint64_t errors = 0;
+
+    while (!__atomic_load_n(&stress->done, __ATOMIC_ACQUIRE)) {
+        char const * seqs[STRESS_MANY];
+        char const * names[STRESS_MANY];
+        for (int k = 0; k < STRESS_MANY; k++)
+            seqs[k] = stress->texts[random_next(&state) % STRESS_SEQUENCES];
+
+        seq_read_begin();
+        char const * name = seq_get_name(stress->storage, seqs[0]);
+        if (!name || !name[0]) errors++;
+        if (seq_get_name_many(stress->storage, seqs, NULL, STRESS_MANY, names) == -1)
+            errors++;
+        for (int k = 0; k < STRESS_MANY; k++)
+            if (!names[k] || !names[k][0]) errors++;
+        seq_read_end();
+    }
+
+    __atomic_fetch_add(&stress->errors, errors, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*Merges and renames classes, ops times.*/
+static void writer(stress_t * stress) {
+    uint64_t state = stress->seed;
+    for (size_t i = 0; i < stress->ops; i++) {
+        char const * s1 = stress->texts[random_next(&state) % STRESS_SEQUENCES];
+        char const * s2 = stress->texts[random_next(&state) % STRESS_SEQUENCES];
+        char name[32];
+        int result = 0;
+
+        switch (i % 4) {
+            case 0:
+            case 1:
+                result = seq_equiv(stress->storage, s1, s2);
+                break;
+            case 2:
+                snprintf(name, sizeof(name), "renamed%zu", i);
+                result = seq_set_name(stress->storage, s1, name);
+                break;
+            default:
+                result = seq_equiv_begin(stress->storage);
+                for (int k = 0; result != -1 && k < STRESS_BATCH; k++) {
+                    s1 = stress->texts[random_next(&state) % STRESS_SEQUENCES];
+                    s2 = stress->texts[random_next(&state) % STRESS_SEQUENCES];
+                    result = seq_equiv_add(stress->storage, s1, s2);
+                }
+                if (result != -1) result = seq_equiv_commit(stress->storage);
+                else seq_equiv_abort(stress->storage);
+        }
+        if (result == -1) stress->errors++;
+    }
+}
+
+int main(int argc, char ** argv) {
+    size_t ops = argc > 1 ? (size_t) strtoull(argv[1], NULL, 10) : 100000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (ops == 0) {
+        fprintf(stderr, "usage: %s [ops [seed]]\n", argv[0]);
+        return 2;
+    }
+
+    stress_t * stress = (stress_t *) calloc(1, sizeof(stress_t));
+    if (stress) stress->storage = seq_new_concurrent();
+    if (!stress || !stress->storage) {
+        fprintf(stderr, "seq_stress: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    stress->ops = ops;
+    stress->seed = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    /*Sequences start with their numbers written in base SEQ_ALPHABET,
+    * so that they are all different, and go on at random.
+    */
+    uint64_t state = stress->seed;
+    for (size_t i = 0; i < STRESS_SEQUENCES; i++) {
+        size_t number = i;
+        for (size_t k = 0; k < STRESS_LENGTH; k++) {
+            stress->texts[i][k] = symbols[k < STRESS_DIGITS
+                ? number % SEQ_ALPHABET : random_next(&state) % SEQ_ALPHABET];
+            if (k < STRESS_DIGITS) number /= SEQ_ALPHABET;
+        }
+        stress->texts[i][STRESS_LENGTH] = '\0';
+    }
+
+    stress_thread_t threads[STRESS_THREADS];
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        threads[t].stress = stress;
+        threads[t].number = t;
+        pthread_create(&threads[t].thread, NULL, adder, &threads[t]);
+    }
+    for (int t = 0; t < STRESS_THREADS; t++) pthread_join(threads[t].thread, NULL);
+
+    for (size_t i = 0; i < STRESS_SEQUENCES; i++) {
+        if (stress->added[i] != 1) stress->errors++;
+
+        char name[32];
+        snprintf(name, sizeof(name), "name%zu", i);
+        if (seq_set_name(stress->storage, stress->texts[i], name) != 1) stress->errors++;
+    }
+
+    for (int t = 0; t < STRESS_THREADS; t++)
+        pthread_create(&threads[t].thread, NULL, reader, &threads[t]);
+    writer(stress);
+    __atomic_store_n(&stress->done, true, __ATOMIC_RELEASE);
+    for (int t = 0; t < STRESS_THREADS; t++) pthread_join(threads[t].thread, NULL);
+
+    uint64_t errors = stress->errors;
+    printf("seq_stress: %zu ops, %llu errors\n", ops, (unsigned long long) errors);
+    seq_delete(stress->storage);
+    free(stress);
+    return errors ? 1 : 0;
+}